@@ -0,0 +1,45 @@
+/*
+ *  bcache.h - Block cache shared by the block filesystem drivers
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "prom.h"
+
+#define BCACHE_BLOCK_SIZE	4096
+
+/* Reads bigger than this are bulk file data and go straight to the device */
+#define BCACHE_BYPASS_SIZE	(4 * BCACHE_BLOCK_SIZE)
+
+/* Read len bytes at byte offset pos of an open device.  Returns the
+ * number of bytes read, like prom_read(). */
+int bcache_read(prom_handle dev, unsigned long long pos, void *buf, int len);
+
+/* Forget every block cached for dev; call before closing it */
+void bcache_invalidate(prom_handle dev);
+
+void bcache_print_stats(void);
+
+#endif
+
+/*
+ * Local variables:
+ * c-file-style: "k&r"
+ * c-basic-offset: 5
+ * End:
+ */
@@ -68,7 +68,9 @@ struct boot_file_t {
 	ino_t		inode;
 	__u64           pos;
 	unsigned char*	buffer;
+	unsigned int	buffer_size;
 	__u64   	len;
+	void*		priv;		/* driver mount context */
 //	unsigned int	dev_blk_size;
 //	unsigned int	part_start;
 //	unsigned int	part_count;
@@ -28,6 +28,7 @@
 
 int fserrorno;
 struct boot_fspec_t;
+struct fs_mount_t;
 
 struct fs_t {
 	const char* name;
@@ -46,12 +47,39 @@ struct fs_t {
 	int (*close)(	struct boot_file_t*	file);
 
 	unsigned int (*ino_size)(struct boot_file_t *file);
+
+	void (*umount)(struct fs_mount_t *mount);
+
+	/* Optional: bring the whole file in at the first free address
+	 * from addr on, leaving it in file->buffer for the caller to
+	 * take over */
+	int (*load)(struct boot_file_t *file, void *addr);
+};
+
+/* A mounted filesystem.  Mounts are kept until the kernel is entered so
+ * that every open_file() on the same partition reuses the driver state.
+ */
+struct fs_mount_t {
+	struct fs_mount_t*	next;
+	char*			dev;
+	int			part_number;	/* -1 for the whole device */
+	struct partition_t	part;
+	const struct fs_t*	fs;
+	void*			priv;		/* driver mount context */
 };
 
 extern const struct fs_t *fs_of;
 extern const struct fs_t *fs_of_netboot;
 
+void of_net_release(void);
+void of_net_tftp_options(char *blksize, char *windowsize);
+
 const struct fs_t *fs_open(struct boot_file_t *file,
 			  struct partition_t *part, struct boot_fspec_t *fspec);
 
+struct fs_mount_t *fs_mount_lookup(const char *dev, int part_number);
+struct fs_mount_t *fs_mount_add(const char *dev, struct partition_t *part,
+				const struct fs_t *fs, void *priv);
+void fs_umount_all(void);
+
 #endif
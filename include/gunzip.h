@@ -0,0 +1,42 @@
+/*
+ *  gunzip.h - Inflate gzip compressed files while they are read
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef GUNZIP_H
+#define GUNZIP_H
+
+#include "file.h"
+
+/* Look at the start of a file just opened, and if it is gzip
+ * compressed make it read the uncompressed data from then on.  Returns
+ * 1 if it was, 0 if the file is rewound and left as it is, or an error:
+ * FILE_ERR_BAD_TYPE for a zstd compressed file, which isn't supported.
+ */
+int gunzip_open(struct boot_file_t *file);
+
+/* Inflate what wasn't read of a file gunzip_open() wrapped and check
+ * the CRC and length in the gzip trailer.  Returns 1 if they match. */
+int gunzip_check(struct boot_file_t *file);
+
+#endif
+
+/*
+ * Local variables:
+ * c-file-style: "k&r"
+ * c-basic-offset: 5
+ * End:
+ */
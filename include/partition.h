@@ -45,6 +45,5 @@ struct partition_t {
 
 extern struct partition_t*	partitions_lookup(const char *device);
 extern char                     *get_part_type(char *device, int partition);
-extern void			partitions_free(struct partition_t* list);
 
 #endif
@@ -49,6 +49,14 @@ extern void prom_init (prom_entry pe);
 
 extern prom_entry prom;
 
+/* Cache block sizes from the cpu node, read by prom_init() */
+extern unsigned int dcache_line_size;
+extern unsigned int icache_line_size;
+/* Block size for dcbz in memset and memcpy, 0 until it is known */
+extern unsigned int dcbz_line_size;
+/* Set if the cpu has AltiVec, for memset and memcpy */
+extern int vmx_enabled;
+
 /* I/O */
 
 extern prom_handle prom_stdin;
@@ -62,6 +70,7 @@ int prom_lseek (prom_handle file, unsigned long long pos);
 int prom_readblocks (prom_handle file, int blockNum, int blockCount, void *buffer);
 void prom_close (prom_handle file);
 int prom_getblksize (prom_handle file);
+unsigned long long prom_getsize (prom_handle file);
 int prom_loadmethod (prom_handle device, void* addr);
 
 #define K_UP    0x141
@@ -94,10 +103,13 @@ int prom_set_color(prom_handle device, int color, int r, int g, int b);
 
 void *prom_claim_chunk(void *virt, unsigned int size, unsigned int align);
 void *prom_claim_chunk_top(unsigned int size, unsigned int align);
+void *prom_claim_rest(void *virt, unsigned int min, unsigned int *size);
 void *prom_claim (void *virt, unsigned int size, unsigned int align);
 void prom_release(void *virt, unsigned int size);
 void prom_map (void *phys, void *virt, int size);
 void prom_print_available(void);
+unsigned long prom_claim_ceiling(void);
+unsigned long prom_largest_free(void);
 
 /* packages and device nodes */
 
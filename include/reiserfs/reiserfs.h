@@ -346,11 +346,22 @@ struct reiserfs_de_head
 #define PATH_MAX       1024     /* include/linux/limits.h */
 #define MAX_LINK_COUNT    5     /* number of symbolic links to follow */
 
-/* Cache stuff, adapted from GRUB source */
-#define FSYSREISER_CACHE_SIZE        (REISERFS_MAX_TREE_HEIGHT*REISERFS_OLD_BLOCKSIZE)
+/* Cache stuff, adapted from GRUB source.  The node cache holds the root
+ * and the most recently used nodes of any path, enough for the internal
+ * nodes above /boot to stay resident across lookups. */
+#define FSYSREISER_CACHE_NODES       16
+#define FSYSREISER_CACHE_SIZE        (FSYSREISER_CACHE_NODES*REISERFS_OLD_BLOCKSIZE)
 #define SECTOR_SIZE                  512
 #define FSYSREISER_MIN_BLOCKSIZE     SECTOR_SIZE
 #define FSYSREISER_MAX_BLOCKSIZE     FSYSREISER_CACHE_SIZE / 3
+#define FSYSREISER_BUF_SIZE          FSYSREISER_CACHE_SIZE
+
+/* Journal map entry: the latest journal copy of a block */
+struct reiserfs_journal_map
+{
+    __u32 realblock;           /* 0 for an empty slot */
+    __u32 journalblock;        /* absolute block number of the copy */
+};
 
 
 struct reiserfs_state
@@ -365,8 +376,11 @@ struct reiserfs_state
     /* Commonly used values, cpu order */
     __u32 journal_block;       /* Start of journal */
     __u32 journal_block_count; /* The size of the journal */
-    __u32 journal_first_desc;  /* The first valid descriptor block in journal
-                                 (relative to journal_block) */
+
+    /* Open addressing hash of the blocks in unflushed transactions */
+    struct reiserfs_journal_map *journal_map;
+    __u32 journal_map_mask;    /* table size - 1 */
+    __u32 journal_map_count;
 
    __u16 version;              /* The ReiserFS version. */
    __u16 tree_depth;           /* The current depth of the reiser tree. */
@@ -375,14 +389,17 @@ struct reiserfs_state
 
     /* Cache */
     __u16 cached_slots;
-    __u16 journal_transactions;
+    char *leaf;                /* Cache slot of the current leaf */
+    __u32 node_block[FSYSREISER_CACHE_NODES]; /* 0 for a free slot */
+    __u32 node_used[FSYSREISER_CACHE_NODES];  /* LRU stamps */
+    __u32 node_clock;
     __u32 blocks[REISERFS_MAX_TREE_HEIGHT];
     __u32 next_key_nr[REISERFS_MAX_TREE_HEIGHT];
 };
 
 #define ROOT     ((char *)FSYS_BUF)
 #define CACHE(i) (ROOT + ((i) * INFO->blocksize))
-#define LEAF     CACHE (BLKH_LEVEL_LEAF)
+#define LEAF     (INFO->leaf)
 
 #define BLOCKHEAD(cache) ((struct block_head *) cache)
 #define ITEMHEAD         ((struct item_head *) ((int) LEAF + BLKH_SIZE))
@@ -390,16 +407,5 @@ struct reiserfs_state
 #define DC(cache)        ((struct disk_child *) \
                                 ((int) cache + BLKH_SIZE + KEY_SIZE * nr_item))
 
-/*
- * The journal cache.  For each transaction it contains the number of
- * blocks followed by the real block numbers of this transaction.
- *
- * If the block numbers of some transaction won't fit in this space,
- * this list is stopped with a 0xffffffff marker and the remaining
- * uncommitted transactions aren't cached.
- */
-#define JOURNAL_START    ((__u32 *) (FSYS_BUF + FSYSREISER_CACHE_SIZE))
-#define JOURNAL_END      ((__u32 *) (FSYS_BUF + sizeof(FSYS_BUF)))
-
 
 #endif /* _REISERFS_H_ */
@@ -0,0 +1,55 @@
+/*
+ *  sha256.h - SHA-256 and checking files against it as they are read
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+struct boot_file_t;
+struct sha256_file;
+
+#define SHA256_DIGEST_SIZE	32
+
+struct sha256_ctx {
+     unsigned int		state[8];
+     unsigned long long	count;		/* bytes hashed */
+     unsigned char		buf[64];
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, unsigned long len);
+void sha256_final(struct sha256_ctx *ctx, unsigned char *digest);
+
+/* Does data hash to digest? */
+int sha256_match(const void *data, unsigned long len, const unsigned char *digest);
+
+/* Make every read of a file just opened hash what it returns, so the
+ * whole file is hashed on the way in.  NULL if out of memory. */
+struct sha256_file *sha256_open(struct boot_file_t *file);
+
+/* Hash what wasn't read of the file yet and compare with digest.
+ * Returns 1 if it matches.  Call before the file is closed. */
+int sha256_check(struct sha256_file *sf, const unsigned char *digest);
+
+#endif
+
+/*
+ * Local variables:
+ * c-file-style: "k&r"
+ * c-basic-offset: 5
+ * End:
+ */
@@ -7,14 +7,34 @@
 
 #include "stdarg.h"
 
+/* Allocation scopes.  malloc() allocates in the current arena and
+ * arena_release() frees whatever is still allocated in one.  Config
+ * data and caches belong in arena_long, which is never released.
+ */
+struct arena {
+	const char	*name;
+	void		*blocks;
+	unsigned long	used;
+	unsigned long	peak;
+	unsigned int	count;
+	struct arena	*next;
+};
+
+#define ARENA_INIT(name)	{ name, 0, 0, 0, 0, 0 }
+
+extern struct arena arena_long;
+
+extern struct arena *arena_enter(struct arena *a);
+extern void arena_leave(struct arena *prev);
+extern void arena_release(struct arena *a);
+
 extern void malloc_init(void *bottom, unsigned long size);
 extern void malloc_dispose(void);
+extern void malloc_stats(void);
 
 extern void *malloc(unsigned int size);
 extern void *realloc(void *ptr, unsigned int size);
 extern void free (void *m);
-extern void mark (void **ptr);
-extern void release (void *ptr);
 
 extern int sprintf(char * buf, const char *fmt, ...);
 extern int vsprintf(char *buf, const char *fmt, va_list args);
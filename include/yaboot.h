@@ -49,6 +49,7 @@
 struct boot_param_t {
 	struct boot_fspec_t	kernel;
 	struct boot_fspec_t	rd;
+	struct boot_fspec_t	sha256;	/* digests of the two, if checked */
 
 	char*	args;
 };
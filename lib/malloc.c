@@ -1,4 +1,4 @@
-/*  malloc.c - Dumb memory allocation routines
+/*  malloc.c - Memory allocation routines
  *
  *  Copyright (C) 1997 Paul Mackerras
  *                1996 Maurizio Plaza
@@ -19,9 +19,25 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 
-#include "types.h"
-#include "stddef.h"
-#include "string.h"
+#ifdef TEST
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <stdarg.h>
+static void free_host(void *p) { free(p); }
+/* Keep the host's allocator for the C library */
+# define malloc		yb_malloc
+# define free		yb_free
+# define realloc	yb_realloc
+# define posix_memalign	yb_posix_memalign
+# define strdup		yb_strdup
+# include "../include/stdlib.h"
+#else
+# include "types.h"
+# include "stddef.h"
+# include "stdlib.h"
+# include "string.h"
+#endif
 
 /* Copied from asm-generic/errno-base.h */
 #define	ENOMEM		12	/* Out of memory */
@@ -29,50 +45,343 @@
 
 /* Imported functions */
 extern void prom_printf (char *fmt, ...);
+extern void *prom_claim_chunk_top (unsigned int size, unsigned int align);
+extern void prom_release (void *virt, unsigned int size);
 
-static char *malloc_ptr = 0;
-static char *malloc_top = 0;
-static char *last_alloc = 0;
+/*
+ * The heap is made of chunks: the one handed to malloc_init() and the
+ * ones claimed from OF when it runs out.  Each chunk is a sequence of
+ * blocks with a 16 byte header ending with a zero sized sentinel.
+ *
+ * Freed blocks of up to SMALL_MAX bytes go to an exact size class list
+ * and are reused as is.  Bigger ones are kept in a single address
+ * ordered list and merged with free neighbours, new blocks are carved
+ * from it first fit.
+ *
+ * Allocated blocks are linked into the arena that was current when they
+ * were allocated, so a whole scope can be freed with arena_release().
+ */
+
+#define ALIGN		16
+#define HDR_SIZE	sizeof(struct block)
+#define MIN_BLOCK	(HDR_SIZE + ALIGN)
+#define SMALL_MAX	512
+#define NR_CLASSES	((SMALL_MAX + HDR_SIZE) / ALIGN + 1)
+
+/* Low bits of block.size */
+#define B_USED		1	/* Allocated */
+#define B_SMALL		2	/* Free, on a size class list */
+#define B_FLAGS		(ALIGN - 1)
+
+/* Heap growth, in bytes */
+#define GROW_MIN	0x100000
+#define GROW_ALIGN	0x10000
+
+struct block {
+    unsigned int size;		/* Whole block including header, and flags */
+    unsigned int prev_size;	/* Size of the block before, 0 at chunk start */
+    struct block *next;		/* Free list or arena links */
+    struct block *prev;
+    struct arena *arena;	/* Owner while allocated */
+} __attribute__ ((aligned (ALIGN)));
+
+struct chunk {
+    struct chunk *next;
+    unsigned int size;
+    int claimed;		/* Claimed by us, released at dispose */
+} __attribute__ ((aligned (ALIGN)));
+
+#define BSIZE(b)	((b)->size & ~B_FLAGS)
+#define NEXT_BLOCK(b)	((struct block *)((char *)(b) + BSIZE(b)))
+#define PREV_BLOCK(b)	((struct block *)((char *)(b) - (b)->prev_size))
+#define PAYLOAD(b)	((void *)((char *)(b) + HDR_SIZE))
+#define BLOCK(p)	((struct block *)((char *)(p) - HDR_SIZE))
+
+static struct chunk *chunks;
+static struct block *free_list;		/* Address ordered */
+static struct block *small_free[NR_CLASSES];
+
+struct arena arena_long = ARENA_INIT("long-lived");
+static struct arena *cur_arena = &arena_long;
+static struct arena *arenas = &arena_long;	/* Known, for malloc_stats() */
+
+/* Telemetry */
+static unsigned long heap_size;
+static unsigned long heap_used;
+static unsigned long heap_peak;
+static unsigned long nr_mallocs, nr_frees, nr_failures, nr_grows;
+
+static void arena_link(struct arena *a, struct block *b)
+{
+    b->arena = a;
+    b->prev = NULL;
+    b->next = a->blocks;
+    if (b->next)
+	b->next->prev = b;
+    a->blocks = b;
+    a->count++;
+    a->used += BSIZE(b);
+    if (a->used > a->peak)
+	a->peak = a->used;
+}
+
+static void arena_unlink(struct block *b)
+{
+    struct arena *a = b->arena;
+
+    if (b->prev)
+	b->prev->next = b->next;
+    else
+	a->blocks = b->next;
+    if (b->next)
+	b->next->prev = b->prev;
+    a->count--;
+    a->used -= BSIZE(b);
+}
+
+static void list_remove(struct block *b)
+{
+    if (b->prev)
+	b->prev->next = b->next;
+    else
+	free_list = b->next;
+    if (b->next)
+	b->next->prev = b->prev;
+}
+
+/* Put a free block on the address ordered list, merging it with its
+ * free neighbours */
+static void list_insert(struct block *b)
+{
+    struct block *n, *p;
+
+    b->size &= ~B_FLAGS;
+
+    n = NEXT_BLOCK(b);
+    if (BSIZE(n) && !(n->size & (B_USED | B_SMALL))) {
+	list_remove(n);
+	b->size += BSIZE(n);
+	NEXT_BLOCK(b)->prev_size = BSIZE(b);
+    }
+    if (b->prev_size) {
+	p = PREV_BLOCK(b);
+	if (!(p->size & (B_USED | B_SMALL))) {
+	    list_remove(p);
+	    p->size += BSIZE(b);
+	    NEXT_BLOCK(p)->prev_size = BSIZE(p);
+	    b = p;
+	}
+    }
+
+    for (p = NULL, n = free_list; n && n < b; p = n, n = n->next)
+	;
+    b->prev = p;
+    b->next = n;
+    if (p)
+	p->next = b;
+    else
+	free_list = b;
+    if (n)
+	n->prev = b;
+}
+
+/* Cut b down to size bytes, returning the tail to the free list */
+static void split(struct block *b, unsigned int size)
+{
+    struct block *rest;
+
+    if (BSIZE(b) - size < MIN_BLOCK)
+	return;
+    rest = (struct block *)((char *)b + size);
+    rest->size = BSIZE(b) - size;
+    rest->prev_size = size;
+    NEXT_BLOCK(rest)->prev_size = BSIZE(rest);
+    b->size = size | (b->size & B_FLAGS);
+    list_insert(rest);
+}
+
+static void add_chunk(void *base, unsigned long size, int claimed)
+{
+    struct chunk *c = base;
+    struct block *b, *end;
+
+    c->next = chunks;
+    c->size = size;
+    c->claimed = claimed;
+    chunks = c;
+
+    b = (struct block *)(c + 1);
+    end = (struct block *)((char *)base + size - HDR_SIZE);
+    b->size = (char *)end - (char *)b;
+    b->prev_size = 0;
+    end->size = B_USED;
+    end->prev_size = BSIZE(b);
+    heap_size += size;
+    list_insert(b);
+}
+
+static int grow(unsigned int need)
+{
+    unsigned int size = need + sizeof(struct chunk) + HDR_SIZE;
+    void *base;
+
+    size = (size + GROW_ALIGN - 1) & ~(GROW_ALIGN - 1);
+    if (size < GROW_MIN)
+	size = GROW_MIN;
+    base = prom_claim_chunk_top(size, 0);
+    if (base == (void *)-1)
+	return 0;
+    nr_grows++;
+    add_chunk(base, size, 1);
+    return 1;
+}
 
 void malloc_init(void *bottom, unsigned long size)
 {
-	malloc_ptr = bottom;
-	malloc_top = bottom + size;
+    int i;
+
+    chunks = NULL;
+    free_list = NULL;
+    for (i = 0; i < NR_CLASSES; i++)
+	small_free[i] = NULL;
+    memset(&arena_long, 0, sizeof(arena_long));
+    arena_long.name = "long-lived";
+    cur_arena = arenas = &arena_long;
+    heap_size = heap_used = heap_peak = 0;
+    nr_mallocs = nr_frees = nr_failures = nr_grows = 0;
+    add_chunk(bottom, size & ~(ALIGN - 1), 0);
 }
 
+/* Give back the chunks claimed while growing, the initial one
+ * belongs to the caller */
 void malloc_dispose(void)
 {
-	malloc_ptr = 0;
-	last_alloc = 0;
+    struct chunk *c, *next;
+
+    for (c = chunks; c; c = next) {
+	next = c->next;
+	if (c->claimed)
+	    prom_release(c, c->size);
+    }
+    chunks = NULL;
+    free_list = NULL;
+    cur_arena = arenas = &arena_long;
+}
+
+/* Make a the arena malloc() allocates in, returning the previous one
+ * for arena_leave() */
+struct arena *arena_enter(struct arena *a)
+{
+    struct arena *prev = cur_arena, *p;
+
+    for (p = arenas; p && p != a; p = p->next)
+	;
+    if (!p) {
+	a->next = arenas;
+	arenas = a;
+    }
+    cur_arena = a;
+    return prev;
+}
+
+void arena_leave(struct arena *prev)
+{
+    cur_arena = prev;
+}
+
+/* Free everything still allocated in a */
+void arena_release(struct arena *a)
+{
+    while (a->blocks)
+	free(PAYLOAD((struct block *)a->blocks));
+}
+
+static void *arena_alloc(struct arena *a, unsigned int size)
+{
+    struct block *b;
+    unsigned int need;
+
+    if (!chunks)
+	return NULL;
+    need = (size + HDR_SIZE + ALIGN - 1) & ~(ALIGN - 1);
+    if (need < MIN_BLOCK)
+	need = MIN_BLOCK;
+    if (need < size) {
+	nr_failures++;
+	return NULL;
+    }
+
+    if (need / ALIGN < NR_CLASSES && (b = small_free[need / ALIGN]) != NULL) {
+	small_free[need / ALIGN] = b->next;
+	goto found;
+    }
+
+    for (;;) {
+	for (b = free_list; b; b = b->next)
+	    if (BSIZE(b) >= need)
+		break;
+	if (b)
+	    break;
+	if (!grow(need)) {
+	    nr_failures++;
+	    prom_printf("malloc failed\n");
+	    return NULL;
+	}
+    }
+    list_remove(b);
+    /* Used before the split, or the tail merges back into it */
+    b->size |= B_USED;
+    split(b, need);
+
+found:
+    b->size = BSIZE(b) | B_USED;
+    arena_link(a, b);
+    nr_mallocs++;
+    heap_used += BSIZE(b);
+    if (heap_used > heap_peak)
+	heap_peak = heap_used;
+    return PAYLOAD(b);
 }
 
 void *malloc (unsigned int size)
 {
-    char *caddr;
+    return arena_alloc(cur_arena, size);
+}
 
-    if (!malloc_ptr)
-    	return NULL;
-    if ((malloc_ptr + size + sizeof(int)) > malloc_top) {
-	prom_printf("malloc failed\n");
-    	return NULL;
-    }
-    *(int *)malloc_ptr = size;
-    caddr = malloc_ptr + sizeof(int);
-    malloc_ptr += size + sizeof(int);
-    last_alloc = caddr;
-    malloc_ptr = (char *) ((((unsigned int) malloc_ptr) + 3) & (~3));
-    return caddr;
+void free (void *m)
+{
+    struct block *b;
+    unsigned int size;
+
+    if (!m || !chunks)
+	return;
+    b = BLOCK(m);
+    if (!(b->size & B_USED)) {
+	prom_printf("free of unallocated %p\n", m);
+	return;
+    }
+    size = BSIZE(b);
+    arena_unlink(b);
+    nr_frees++;
+    heap_used -= size;
+
+    if (size / ALIGN < NR_CLASSES) {
+	b->size = size | B_SMALL;
+	b->next = small_free[size / ALIGN];
+	small_free[size / ALIGN] = b;
+	return;
+    }
+    list_insert(b);
 }
 
 /* Do not fall back to the malloc above as posix_memalign is needed by
  * external libraries not yaboot */
 int posix_memalign(void **memptr, size_t alignment, size_t size)
 {
-    char *caddr;
-    /* size of allocation including the alignment */
-    size_t alloc_size;
+    struct block *b, *a;
+    char *p, *q;
 
-    if (!malloc_ptr)
+    if (!chunks)
         return EINVAL;
 
     /* Minimal aligment is sizeof(void *) */
@@ -88,66 +397,105 @@ int posix_memalign(void **memptr, size_t alignment, size_t size)
 	return 0;
     }
 
-    caddr = (char*)(
-             (size_t)((malloc_ptr + sizeof(int))+(alignment-1)) &
-             (~(alignment-1))
-            );
-
-    alloc_size = size + (caddr - (malloc_ptr+sizeof(int)));
-
-    if ((malloc_ptr + alloc_size + sizeof(int)) > malloc_top)
-        return ENOMEM;
-
-    *(int *)(caddr - sizeof(int)) = size;
-    malloc_ptr += alloc_size + sizeof(int);
-    last_alloc = caddr;
-    malloc_ptr = (char *) ((((unsigned int) malloc_ptr) + 3) & (~3));
-    *memptr=(void*)caddr;
+    if (alignment <= ALIGN) {
+	*memptr = malloc(size);
+	return *memptr ? 0 : ENOMEM;
+    }
 
+    /* Over allocate, then free the misaligned head */
+    p = malloc(size + alignment + MIN_BLOCK);
+    if (!p)
+	return ENOMEM;
+    q = (char *)(((size_t)p + MIN_BLOCK + alignment - 1) & ~(alignment - 1));
+    if (((size_t)p & (alignment - 1)) == 0) {
+	*memptr = p;
+	return 0;
+    }
+    b = BLOCK(p);
+    a = BLOCK(q);
+    arena_unlink(b);
+    a->size = (BSIZE(b) - (q - p)) | B_USED;
+    a->prev_size = q - p;
+    NEXT_BLOCK(a)->prev_size = BSIZE(a);
+    b->size = (q - p) | B_USED;
+    arena_link(cur_arena, a);
+    arena_link(cur_arena, b);
+    free(p);
+    *memptr = q;
     return 0;
 }
 
 void *realloc(void *ptr, unsigned int size)
 {
-    char *caddr, *oaddr = ptr;
+    struct block *b, *n;
+    unsigned int need;
+    char *caddr;
 
-    if (!malloc_ptr)
-    	return NULL;
-    if (oaddr == last_alloc) {
-	if (oaddr + size > malloc_top) {
-		prom_printf("realloc failed\n");
-		return NULL;
-	}
-	*(int *)(oaddr - sizeof(int)) = size;
-	malloc_ptr = oaddr + size;
-	return oaddr;
+    if (!ptr)
+	return malloc(size);
+    b = BLOCK(ptr);
+    need = (size + HDR_SIZE + ALIGN - 1) & ~(ALIGN - 1);
+    if (need < MIN_BLOCK)
+	need = MIN_BLOCK;
+    if (need <= BSIZE(b))
+	return ptr;
+
+    /* Grow in place into a free neighbour */
+    n = NEXT_BLOCK(b);
+    if (BSIZE(n) && !(n->size & (B_USED | B_SMALL))
+	&& BSIZE(b) + BSIZE(n) >= need) {
+	struct arena *a = b->arena;
+
+	heap_used -= BSIZE(b);
+	arena_unlink(b);
+	list_remove(n);
+	b->size += BSIZE(n);
+	NEXT_BLOCK(b)->prev_size = BSIZE(b);
+	split(b, need);
+	arena_link(a, b);
+	heap_used += BSIZE(b);
+	if (heap_used > heap_peak)
+	    heap_peak = heap_used;
+	return ptr;
+    }
+
+    /* Moved blocks stay in their arena */
+    caddr = arena_alloc(b->arena, size);
+    if (caddr) {
+	memcpy(caddr, ptr, BSIZE(b) - HDR_SIZE);
+	free(ptr);
     }
-    caddr = malloc(size);
-    if (caddr != 0 && oaddr != 0)
-	memcpy(caddr, oaddr, *(int *)(oaddr - sizeof(int)));
     return caddr;
 }
 
-void free (void *m)
+void malloc_stats(void)
 {
-    if (!malloc_ptr)
-    	return;
-    if (m == last_alloc)
-	malloc_ptr = (char *) last_alloc - sizeof(int);
-}
+    struct block *b;
+    unsigned long free_bytes = 0, largest = 0;
+    int i, nchunks = 0;
+    struct chunk *c;
+    struct arena *a;
 
-void mark (void **ptr)
-{
-    if (!malloc_ptr)
-    	return;
-    *ptr = (void *) malloc_ptr;
-}
+    for (c = chunks; c; c = c->next)
+	nchunks++;
+    for (b = free_list; b; b = b->next) {
+	free_bytes += BSIZE(b);
+	if (BSIZE(b) > largest)
+	    largest = BSIZE(b);
+    }
+    for (i = 0; i < NR_CLASSES; i++)
+	for (b = small_free[i]; b; b = b->next)
+	    free_bytes += BSIZE(b);
 
-void release (void *ptr)
-{
-    if (!malloc_ptr)
-    	return;
-    malloc_ptr = (char *) ptr;
+    prom_printf("heap: %lu bytes in %d chunks (%lu grows)\n",
+		heap_size, nchunks, nr_grows);
+    prom_printf("      %lu in use, %lu peak, %lu free, %lu largest free\n",
+		heap_used, heap_peak, free_bytes, largest);
+    prom_printf("      %lu mallocs, %lu frees, %lu failures\n",
+		nr_mallocs, nr_frees, nr_failures);
+    for (a = arenas; a; a = a->next)
+	prom_printf("arena %-12s %5u blocks, %lu bytes, %lu peak\n",
+		    a->name, a->count, a->used, a->peak);
 }
 
 char *strdup(char const *str)
@@ -157,3 +505,235 @@ char *strdup(char const *str)
 	 strcpy(p, str);
     return p;
 }
+
+#ifdef TEST
+
+/* Host test of the allocator, checking the heap is consistent after
+ * every step:
+ *	gcc -O2 -DTEST -o malloc-test lib/malloc.c && ./malloc-test
+ */
+
+void prom_printf (char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+void *prom_claim_chunk_top (unsigned int size, unsigned int align)
+{
+    void *p = aligned_alloc(GROW_ALIGN, size);
+
+    return p ? p : (void *)-1;
+}
+
+void prom_release (void *virt, unsigned int size)
+{
+    (void)size;
+    free_host(virt);
+}
+
+static int failures;
+
+#define CHECK(cond) do {						\
+    if (!(cond)) {							\
+	printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond);	\
+	failures++;							\
+    }									\
+} while (0)
+
+/* Walk every chunk and the free lists.  Returns the bytes free, and
+ * the number of blocks on the big free list in *nfree. */
+static unsigned long check_heap(int *nfree)
+{
+    struct chunk *c;
+    struct block *b, *p;
+    unsigned long free_bytes, big_bytes = 0, listed = 0;
+    int i, n = 0;
+
+    for (c = chunks; c; c = c->next) {
+	unsigned int prev = 0, prev_flags = B_USED;
+
+	for (b = (struct block *)(c + 1); BSIZE(b); b = NEXT_BLOCK(b)) {
+	    CHECK(b->prev_size == prev);
+	    CHECK(((unsigned long)b & (ALIGN - 1)) == 0);
+	    CHECK((char *)NEXT_BLOCK(b) < (char *)c + c->size);
+	    if (!(b->size & (B_USED | B_SMALL))) {
+		/* Big free blocks are always merged */
+		CHECK(prev_flags & (B_USED | B_SMALL));
+		big_bytes += BSIZE(b);
+	    }
+	    prev = BSIZE(b);
+	    prev_flags = b->size & B_FLAGS;
+	}
+	CHECK(b->prev_size == prev);
+    }
+    for (p = NULL, b = free_list; b; p = b, b = b->next) {
+	CHECK(b->prev == p);
+	CHECK(!p || p < b);
+	CHECK(!(b->size & (B_USED | B_SMALL)));
+	listed += BSIZE(b);
+	n++;
+    }
+    CHECK(listed == big_bytes);
+    free_bytes = big_bytes;
+    for (i = 0; i < NR_CLASSES; i++)
+	for (b = small_free[i]; b; b = b->next) {
+	    CHECK(b->size == (i * ALIGN | B_SMALL));
+	    free_bytes += BSIZE(b);
+	}
+    if (nfree)
+	*nfree = n;
+    return free_bytes;
+}
+
+static void fill(void *p, unsigned int size, int seed)
+{
+    unsigned char *c = p;
+
+    while (size--)
+	*c++ = seed++;
+}
+
+static int filled(void *p, unsigned int size, int seed)
+{
+    unsigned char *c = p;
+
+    while (size--)
+	if (*c++ != (unsigned char)seed++)
+	    return 0;
+    return 1;
+}
+
+#define HEAP_SIZE	0x100000
+#define NR_SLOTS	256
+
+static char heap[HEAP_SIZE] __attribute__ ((aligned (ALIGN)));
+
+int main(void)
+{
+    static void *slot[NR_SLOTS];
+    static unsigned int slot_size[NR_SLOTS];
+    struct arena scope = ARENA_INIT("test");
+    struct arena *prev;
+    unsigned long whole;
+    unsigned int seed = 1;
+    void *a, *b, *c;
+    int i, n;
+
+    malloc_init(heap, sizeof(heap));
+    whole = check_heap(&n);
+    CHECK(n == 1);
+
+    /* Back to back allocations from the big list */
+    a = malloc(1000);
+    b = malloc(1000);
+    CHECK(a && b && a != b);
+    CHECK((char *)b >= (char *)a + 1000 || (char *)a >= (char *)b + 1000);
+    fill(a, 1000, 1);
+    fill(b, 1000, 2);
+    CHECK(filled(a, 1000, 1) && filled(b, 1000, 2));
+    check_heap(NULL);
+
+    /* Freed in either order they merge back into one block */
+    free(a);
+    free(b);
+    CHECK(check_heap(&n) == whole && n == 1);
+    a = malloc(1000);
+    b = malloc(1000);
+    c = malloc(1000);
+    free(b);
+    free(a);
+    free(c);
+    CHECK(check_heap(&n) == whole && n == 1);
+
+    /* Small blocks are reused as is */
+    a = malloc(40);
+    free(a);
+    CHECK(malloc(40) == a);
+    free(a);
+
+    /* realloc grows into a free neighbour, and moves otherwise */
+    a = malloc(1000);
+    b = malloc(1000);
+    c = malloc(1000);
+    fill(a, 1000, 3);
+    free(b);
+    CHECK(realloc(a, 1800) == a);
+    CHECK(filled(a, 1000, 3));
+    check_heap(NULL);
+    b = realloc(a, 8000);
+    CHECK(b && b != a && filled(b, 1000, 3));
+    free(b);
+    free(c);
+    CHECK(check_heap(&n) == whole && n == 1);
+
+    /* Arenas free what is left in them */
+    prev = arena_enter(&scope);
+    for (i = 0; i < 50; i++)
+	malloc(i * 37 + 600);
+    arena_leave(prev);
+    CHECK(scope.count == 50);
+    arena_release(&scope);
+    CHECK(scope.count == 0 && scope.used == 0);
+    CHECK(check_heap(&n) == whole && n == 1);
+
+    /* Aligned allocations */
+    for (i = 16; i <= 0x10000; i <<= 1) {
+	CHECK(posix_memalign(&a, i, 3000) == 0);
+	CHECK(((unsigned long)a & (i - 1)) == 0);
+	fill(a, 3000, i);
+	check_heap(NULL);
+	CHECK(filled(a, 3000, i));
+	free(a);
+    }
+    CHECK(posix_memalign(&a, 24, 100) == EINVAL);
+    /* The misaligned heads are small and stay on their size lists */
+    CHECK(check_heap(NULL) == whole);
+
+    /* Random work, growing the heap on the way */
+    for (i = 0; i < 200000; i++) {
+	int s = (seed = seed * 1103515245 + 12345) >> 8 & (NR_SLOTS - 1);
+	unsigned int size = (seed >> 3) % ((seed & 0x100) ? 600 : 40000) + 1;
+
+	if (slot[s]) {
+	    CHECK(filled(slot[s], slot_size[s], s));
+	    if (seed & 0x20000) {
+		free(slot[s]);
+		slot[s] = NULL;
+		continue;
+	    }
+	    a = realloc(slot[s], size);
+	    CHECK(a != NULL);
+	    if (!a)
+		continue;
+	    CHECK(filled(a, size < slot_size[s] ? size : slot_size[s], s));
+	    slot[s] = a;
+	} else {
+	    slot[s] = malloc(size);
+	    CHECK(slot[s] != NULL);
+	    if (!slot[s])
+		continue;
+	}
+	slot_size[s] = size;
+	fill(slot[s], size, s);
+	if (i % 1000 == 0)
+	    check_heap(NULL);
+    }
+    for (i = 0; i < NR_SLOTS; i++)
+	if (slot[i]) {
+	    CHECK(filled(slot[i], slot_size[i], i));
+	    free(slot[i]);
+	}
+    check_heap(NULL);
+    CHECK(heap_used == 0 && arena_long.count == 0);
+    malloc_stats();
+    malloc_dispose();
+
+    printf("malloc test %s\n", failures ? "FAILED" : "OK");
+    return failures != 0;
+}
+
+#endif /* TEST */
@@ -0,0 +1,235 @@
+/*
+ *  string-test.c - Check and time memset and memcpy from string.S
+ *
+ *  This runs on a PowerPC Linux host or under qemu-user, with the
+ *  routines from string.S linked in under other names so the C library
+ *  keeps its own:
+ *	powerpc-linux-gnu-gcc -O2 -static -DTEST -D__ASSEMBLY__ -Iinclude \
+ *		-Wa,-maltivec -o string-test lib/string-test.c lib/string.S
+ *	qemu-ppc -cpu 7400 ./string-test
+ *  Every path is checked against byte loops first, then timed: the plain
+ *  word loops, dcbz for zeroing and copies, and AltiVec for both.  Under
+ *  qemu only the ratios between the paths mean anything.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/auxv.h>
+
+#ifndef PPC_FEATURE_HAS_ALTIVEC
+# define PPC_FEATURE_HAS_ALTIVEC	0x10000000
+#endif
+
+void *yb_memset(void *s, int c, size_t n);
+void *yb_memcpy(void *dest, const void *src, size_t n);
+void *yb_memmove(void *dest, const void *src, size_t n);
+
+/* Set by prom_cpu_init() in yaboot, by main() here */
+unsigned int dcbz_line_size;
+int vmx_enabled;
+
+struct mode {
+     const char		*name;
+     unsigned int	dcbz;
+     int		vmx;
+};
+
+#define GUARD		64
+#define CHECK_MAX	4096
+#define BENCH_BYTES	(256 << 20)
+
+static int failures;
+
+/* Same as prom_dcbz_size() */
+static unsigned int
+dcbz_size(void)
+{
+     static unsigned char probe[2048] __attribute__ ((aligned (1024)));
+     unsigned int i, n;
+
+     memset(probe, 0xff, sizeof(probe));
+     __asm__ __volatile__ ("dcbz 0,%0" : : "r" (probe) : "memory");
+     for (n = 0; n < sizeof(probe) && probe[n] == 0; n++)
+	  ;
+     for (i = n; i < sizeof(probe); i++)
+	  if (probe[i] != 0xff)
+	       return 0;
+     return n;
+}
+
+/* What Linux says the CPU has, in place of the device tree */
+static int
+has_altivec(void)
+{
+     return (getauxval(AT_HWCAP) & PPC_FEATURE_HAS_ALTIVEC) != 0;
+}
+
+static void
+fail(const char *what, size_t off, size_t srcoff, size_t len)
+{
+     if (failures++ < 20)
+	  printf("  %s failed: offset %lu, source offset %lu, length %lu\n",
+		 what, (unsigned long)off, (unsigned long)srcoff,
+		 (unsigned long)len);
+}
+
+static void
+pattern(unsigned char *p, size_t len, unsigned int seed)
+{
+     while (len--)
+	  *p++ = (seed = seed * 1103515245 + 12345) >> 16;
+}
+
+/* Compare against a copy done a byte at a time, guards included */
+static void
+check(unsigned char *buf, unsigned char *ref, unsigned char *src)
+{
+     static const size_t big[] = { 1000, 1024, 1500, 2048, 3000, CHECK_MAX };
+     size_t off, srcoff, len, i;
+     int c;
+
+     for (off = 0; off < 16; off++)
+	  for (len = 0; len < 300 + sizeof(big) / sizeof(big[0]); len++) {
+	       size_t n = len < 300 ? len : big[len - 300];
+
+	       for (c = 0; c < 0x100; c += 0xa5) {
+		    pattern(buf, CHECK_MAX + 2 * GUARD, n);
+		    memcpy(ref, buf, CHECK_MAX + 2 * GUARD);
+		    for (i = 0; i < n; i++)
+			 ref[GUARD + off + i] = c;
+		    if (yb_memset(buf + GUARD + off, c, n) != buf + GUARD + off
+			|| memcmp(buf, ref, CHECK_MAX + 2 * GUARD))
+			 fail(c ? "memset" : "memset 0", off, 0, n);
+	       }
+	       for (srcoff = 0; srcoff < 16; srcoff += (n < 300 ? 1 : 5)) {
+		    pattern(src, CHECK_MAX + 2 * GUARD, ~n);
+		    pattern(buf, CHECK_MAX + 2 * GUARD, n);
+		    memcpy(ref, buf, CHECK_MAX + 2 * GUARD);
+		    for (i = 0; i < n; i++)
+			 ref[GUARD + off + i] = src[GUARD + srcoff + i];
+		    if (yb_memcpy(buf + GUARD + off, src + GUARD + srcoff, n)
+			!= buf + GUARD + off
+			|| memcmp(buf, ref, CHECK_MAX + 2 * GUARD))
+			 fail("memcpy", off, srcoff, n);
+	       }
+	  }
+
+     /* memmove down onto itself goes through memcpy */
+     for (off = 0; off < 300; off += 3)
+	  for (len = 100; len <= CHECK_MAX - 300; len += 997) {
+	       pattern(buf, CHECK_MAX + 2 * GUARD, len);
+	       memcpy(ref, buf, CHECK_MAX + 2 * GUARD);
+	       for (i = 0; i < len; i++)
+		    ref[GUARD + i] = ref[GUARD + off + i];
+	       yb_memmove(buf + GUARD, buf + GUARD + off, len);
+	       if (memcmp(buf, ref, CHECK_MAX + 2 * GUARD))
+		    fail("memmove", 0, off, len);
+	  }
+}
+
+static double
+rate(clock_t start, unsigned long bytes)
+{
+     double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+     return secs > 0 ? (bytes >> 20) / secs : 0.0;
+}
+
+static void
+bench(unsigned char *dst, unsigned char *src)
+{
+     static const size_t sizes[] = { 256, 4096, 65536, 1 << 20, 16 << 20 };
+     unsigned int i, n, rounds;
+     clock_t start;
+
+     printf("  %10s %10s %10s %10s %10s\n", "bytes", "memset 0",
+	    "memset", "memcpy", "unaligned");
+     for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	  double zero, fill, copy, skew;
+
+	  rounds = BENCH_BYTES / sizes[i];
+	  start = clock();
+	  for (n = 0; n < rounds; n++)
+	       yb_memset(dst, 0, sizes[i]);
+	  zero = rate(start, BENCH_BYTES);
+	  start = clock();
+	  for (n = 0; n < rounds; n++)
+	       yb_memset(dst, 0x5a, sizes[i]);
+	  fill = rate(start, BENCH_BYTES);
+	  start = clock();
+	  for (n = 0; n < rounds; n++)
+	       yb_memcpy(dst, src, sizes[i]);
+	  copy = rate(start, BENCH_BYTES);
+	  start = clock();
+	  for (n = 0; n < rounds; n++)
+	       yb_memcpy(dst + 1, src + 6, sizes[i] - 8);
+	  skew = rate(start, BENCH_BYTES);
+	  printf("  %10lu %10.1f %10.1f %10.1f %10.1f  MB/s\n",
+		 (unsigned long)sizes[i], zero, fill, copy, skew);
+     }
+}
+
+int
+main(void)
+{
+     struct mode modes[] = {
+	  { "scalar",	0, 0 },
+	  { "dcbz",	0, 0 },
+	  { "vmx",	0, 0 },
+     };
+     unsigned char *buf, *ref, *src, *dst, *bsrc;
+     unsigned int dcbz = dcbz_size();
+     unsigned int m;
+
+     printf("dcbz clears %u bytes\n", dcbz);
+     if (dcbz >= 32 && dcbz <= 1024 && !(dcbz & (dcbz - 1)))
+	  modes[1].dcbz = dcbz;
+     modes[2].vmx = has_altivec();
+
+     buf = malloc(CHECK_MAX + 2 * GUARD);
+     ref = malloc(CHECK_MAX + 2 * GUARD);
+     src = malloc(CHECK_MAX + 2 * GUARD);
+     dst = aligned_alloc(4096, 16 << 20);
+     bsrc = aligned_alloc(4096, 16 << 20);
+     if (!buf || !ref || !src || !dst || !bsrc)
+	  return 1;
+     memset(bsrc, 0x33, 16 << 20);
+
+     for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+	  if (m && !modes[m].dcbz && !modes[m].vmx) {
+	       printf("%s: not available\n", modes[m].name);
+	       continue;
+	  }
+	  dcbz_line_size = modes[m].dcbz;
+	  vmx_enabled = modes[m].vmx;
+	  printf("%s:\n", modes[m].name);
+	  check(buf, ref, src);
+	  bench(dst, bsrc);
+     }
+
+     printf("string test %s\n", failures ? "FAILED" : "OK");
+     return failures != 0;
+}
+
+/*
+ * Local variables:
+ * c-file-style: "k&r"
+ * c-basic-offset: 5
+ * End:
+ */
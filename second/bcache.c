@@ -0,0 +1,351 @@
+/*
+ *  bcache.c - Block cache shared by the block filesystem drivers
+ *
+ *  The ext2, xfs and reiserfs drivers all read their metadata (superblock,
+ *  group descriptors, inodes, directory and tree blocks) a few hundred bytes
+ *  at a time, and each prom_read() is a round trip through Open Firmware
+ *  and its deblocker.  This keeps the most recently used 4k disk blocks,
+ *  keyed by device ihandle and disk byte offset, so the same block is only
+ *  fetched once.  The cache never writes; entries are dropped when a driver
+ *  closes its device.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifdef TEST
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+/* Just the part of prom.h the cache uses; its types.h fights the host's */
+# define PROM_H
+typedef void *prom_handle;
+int prom_read(prom_handle dev, void *buf, int len);
+int prom_lseek(prom_handle dev, unsigned long long pos);
+void prom_debug(const char *fmt, ...);
+# include "../include/bcache.h"
+# define DEBUG_F(fmt, args...)
+/* A cache of a few blocks, to see them replaced */
+# define BCACHE_BLOCKS		8
+/* The cache is allocated in the long-lived arena, as in yaboot */
+struct arena {
+     const char		*name;
+};
+static struct arena arena_long = { "long-lived" };
+static struct arena arena_test = { "test" };
+static struct arena *cur_arena = &arena_test;
+static struct arena *arena_enter(struct arena *a)
+{
+     struct arena *prev = cur_arena;
+
+     cur_arena = a;
+     return prev;
+}
+static void arena_leave(struct arena *prev)
+{
+     cur_arena = prev;
+}
+static struct arena *alloc_arena;	/* where the last malloc() went */
+static void *arena_malloc(size_t size)
+{
+     alloc_arena = cur_arena;
+     return malloc(size);
+}
+# define malloc			arena_malloc
+#else
+# include "stdlib.h"
+# include "string.h"
+# include "prom.h"
+# include "bcache.h"
+# include "debug.h"
+
+/* Give the cache an eighth of the malloc pool */
+# define BCACHE_BLOCKS		(MALLOCSIZE / 8 / BCACHE_BLOCK_SIZE)
+#endif
+
+struct bcache_entry {
+     prom_handle		dev;		/* NULL if the entry is free */
+     unsigned long long	pos;		/* block aligned disk byte offset */
+     int			valid;		/* bytes read, short at end of disk */
+     unsigned long		stamp;		/* last use, for LRU replacement */
+     char			*data;
+};
+
+static struct bcache_entry *bcache;
+static int bcache_blocks;
+static unsigned long bcache_clock;
+static unsigned long bcache_hits, bcache_misses, bcache_bypassed;
+
+static int
+bcache_init(void)
+{
+     struct arena *prev;
+     char *data;
+     int i;
+
+     prev = arena_enter(&arena_long);
+     bcache = malloc(BCACHE_BLOCKS * sizeof(struct bcache_entry));
+     data = malloc(BCACHE_BLOCKS * BCACHE_BLOCK_SIZE);
+     arena_leave(prev);
+     if (!bcache || !data) {
+	  DEBUG_F("no memory for the block cache\n");
+	  bcache = NULL;
+	  return 0;
+     }
+     for (i = 0; i < BCACHE_BLOCKS; i++) {
+	  bcache[i].dev = NULL;
+	  bcache[i].data = data + i * BCACHE_BLOCK_SIZE;
+     }
+     bcache_blocks = BCACHE_BLOCKS;
+     return 1;
+}
+
+/* Return the entry holding the block at pos, reading it in if needed */
+static struct bcache_entry *
+bcache_get(prom_handle dev, unsigned long long pos)
+{
+     struct bcache_entry *e, *victim = NULL;
+     int i;
+
+     for (i = 0; i < bcache_blocks; i++) {
+	  e = &bcache[i];
+	  if (e->dev == dev && e->pos == pos) {
+	       bcache_hits++;
+	       e->stamp = ++bcache_clock;
+	       return e;
+	  }
+	  if (!victim || (victim->dev && (!e->dev || e->stamp < victim->stamp)))
+	       victim = e;
+     }
+
+     bcache_misses++;
+     victim->dev = NULL;
+     if (!prom_lseek(dev, pos))
+	  return NULL;
+     victim->valid = prom_read(dev, victim->data, BCACHE_BLOCK_SIZE);
+     if (victim->valid <= 0)
+	  return NULL;
+     victim->dev = dev;
+     victim->pos = pos;
+     victim->stamp = ++bcache_clock;
+     return victim;
+}
+
+int
+bcache_read(prom_handle dev, unsigned long long pos, void *buf, int len)
+{
+     struct bcache_entry *e;
+     char *p = buf;
+     int done = 0;
+
+     if (len > BCACHE_BYPASS_SIZE || (!bcache && !bcache_init())) {
+	  bcache_bypassed++;
+	  if (!prom_lseek(dev, pos))
+	       return 0;
+	  return prom_read(dev, buf, len);
+     }
+
+     while (done < len) {
+	  unsigned long long blk = pos & ~(unsigned long long)(BCACHE_BLOCK_SIZE - 1);
+	  int off = pos - blk;
+	  int n = BCACHE_BLOCK_SIZE - off;
+
+	  if (n > len - done)
+	       n = len - done;
+	  e = bcache_get(dev, blk);
+	  if (!e)
+	       return done ? done : -1;
+	  if (off >= e->valid)
+	       break;
+	  if (n > e->valid - off)
+	       n = e->valid - off;
+	  memcpy(p, e->data + off, n);
+	  p += n;
+	  pos += n;
+	  done += n;
+	  if (e->valid < BCACHE_BLOCK_SIZE)
+	       break;
+     }
+     return done;
+}
+
+void
+bcache_invalidate(prom_handle dev)
+{
+     int i;
+
+     for (i = 0; i < bcache_blocks; i++)
+	  if (bcache[i].dev == dev)
+	       bcache[i].dev = NULL;
+}
+
+void
+bcache_print_stats(void)
+{
+     prom_debug("block cache: %lu hits, %lu misses, %lu bypassed\n",
+		bcache_hits, bcache_misses, bcache_bypassed);
+}
+
+#ifdef TEST
+
+/* Reads through the cache from files standing in for disks, checked
+ * against the files and against what the disks were asked for:
+ *	gcc -O2 -DTEST -o bcache-test second/bcache.c && ./bcache-test
+ */
+
+#define DISK_SIZE	(100 * BCACHE_BLOCK_SIZE + 123)
+
+struct disk {
+     FILE		*file;
+     unsigned char	*data;		/* what the file holds */
+     long long		pos;
+     int		reads;
+};
+
+static int failures;
+
+#define CHECK(cond) do {						\
+     if (!(cond)) {							\
+	  printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond);	\
+	  failures++;							\
+     }									\
+} while (0)
+
+int
+prom_lseek(prom_handle dev, unsigned long long pos)
+{
+     struct disk *d = dev;
+
+     d->pos = pos;
+     return fseek(d->file, pos, SEEK_SET) == 0;
+}
+
+int
+prom_read(prom_handle dev, void *buf, int len)
+{
+     struct disk *d = dev;
+     int got;
+
+     d->reads++;
+     got = fread(buf, 1, len, d->file);
+     d->pos += got;
+     return got;
+}
+
+void
+prom_debug(const char *fmt, ...)
+{
+}
+
+static void
+disk_open(struct disk *d, unsigned int seed)
+{
+     int i;
+
+     d->data = malloc(DISK_SIZE);
+     for (i = 0; i < DISK_SIZE; i++)
+	  d->data[i] = (seed = seed * 1103515245 + 12345) >> 16;
+     d->file = tmpfile();
+     fwrite(d->data, 1, DISK_SIZE, d->file);
+     d->reads = 0;
+}
+
+/* Read through the cache and compare, returning the disk reads it took */
+static int
+check_read(struct disk *d, long long pos, int len)
+{
+     static unsigned char buf[8 * BCACHE_BLOCK_SIZE];
+     int reads = d->reads, want, got;
+
+     want = pos + len > DISK_SIZE ? DISK_SIZE - pos : len;
+     memset(buf, 0xa5, sizeof(buf));
+     got = bcache_read(d, pos, buf, len);
+     CHECK(got == want);
+     if (got > 0)
+	  CHECK(!memcmp(buf, d->data + pos, got));
+     return d->reads - reads;
+}
+
+int
+main(void)
+{
+     struct disk a, b;
+     int i;
+
+     disk_open(&a, 1);
+     disk_open(&b, 2);
+
+     /* Small reads within and across blocks, read once */
+     CHECK(check_read(&a, 100, 200) == 1);
+     CHECK(alloc_arena == &arena_long);
+     CHECK(check_read(&a, 300, 500) == 0);
+     CHECK(check_read(&a, BCACHE_BLOCK_SIZE - 10, 20) == 1);
+     CHECK(check_read(&a, 0, 2 * BCACHE_BLOCK_SIZE) == 0);
+
+     /* The same offsets on another disk are other blocks */
+     CHECK(check_read(&b, 100, 200) == 1);
+
+     /* Bigger reads go straight to the disk and aren't kept */
+     CHECK(check_read(&a, 10 * BCACHE_BLOCK_SIZE + 7, BCACHE_BYPASS_SIZE + 1) == 1);
+     CHECK(check_read(&a, 10 * BCACHE_BLOCK_SIZE + 7, 10) == 1);
+     CHECK(check_read(&a, 10 * BCACHE_BLOCK_SIZE + 7, BCACHE_BYPASS_SIZE) == 4);
+
+     /* The end of the disk is a short block */
+     CHECK(check_read(&a, DISK_SIZE - 50, 200) == 1);
+     CHECK(check_read(&a, DISK_SIZE - 100, 40) == 0);
+
+     /* The least recently used block goes first: fill the cache with
+      * blocks 20 to 27, use 20 again, then 28 replaces 21 */
+     for (i = 20; i < 28; i++)
+	  CHECK(check_read(&a, i * BCACHE_BLOCK_SIZE, 16) == 1);
+     CHECK(check_read(&a, 20 * BCACHE_BLOCK_SIZE + 100, 16) == 0);
+     CHECK(check_read(&a, 28 * BCACHE_BLOCK_SIZE, 16) == 1);
+     CHECK(check_read(&a, 20 * BCACHE_BLOCK_SIZE, 16) == 0);
+     for (i = 22; i < 29; i++)
+	  CHECK(check_read(&a, i * BCACHE_BLOCK_SIZE, 16) == 0);
+     CHECK(check_read(&a, 21 * BCACHE_BLOCK_SIZE, 16) == 1);
+
+     /* Invalidating a disk drops its blocks and no other's */
+     CHECK(check_read(&b, 20 * BCACHE_BLOCK_SIZE, 16) == 1);
+     CHECK(check_read(&a, 28 * BCACHE_BLOCK_SIZE, 16) == 0);
+     bcache_invalidate(&a);
+     CHECK(check_read(&b, 20 * BCACHE_BLOCK_SIZE, 16) == 0);
+     CHECK(check_read(&a, 28 * BCACHE_BLOCK_SIZE, 16) == 1);
+     CHECK(check_read(&a, 28 * BCACHE_BLOCK_SIZE + 8, 16) == 0);
+
+     /* Everything comes back right through a busy cache */
+     for (i = 0; i < 100000; i++) {
+	  long long pos = (i * 7919LL * 131) % DISK_SIZE;
+	  int len = (i * 37) % (3 * BCACHE_BLOCK_SIZE) + 1;
+
+	  check_read(i & 1 ? &a : &b, pos, len);
+     }
+
+     /* Whatever the cache allocated, it left the arena as it was */
+     CHECK(cur_arena == &arena_test);
+
+     printf("bcache: %lu hits, %lu misses, %lu bypassed\n",
+	    bcache_hits, bcache_misses, bcache_bypassed);
+     printf("bcache test %s\n", failures ? "FAILED" : "OK");
+     return failures != 0;
+}
+
+#endif /* TEST */
+
+/*
+ * Local variables:
+ * c-file-style: "k&r"
+ * c-basic-offset: 5
+ * End:
+ */
@@ -50,6 +50,9 @@ CONFIG cf_options[] =
      {cft_strg, "partition", NULL},
      {cft_strg, "default", NULL},
      {cft_strg, "timeout", NULL},
+     {cft_flag, "preload", NULL},
+     {cft_strg, "tftp-blksize", NULL},
+     {cft_strg, "tftp-windowsize", NULL},
      {cft_strg, "password", NULL},
      {cft_flag, "restricted", NULL},
      {cft_strg, "message", NULL},
@@ -61,6 +64,7 @@ CONFIG cf_options[] =
      {cft_strg, "initrd", NULL},
      {cft_flag, "initrd-prompt", NULL},
      {cft_strg, "initrd-size", NULL},
+     {cft_strg, "sha256", NULL},
      {cft_flag, "pause-after", NULL},
      {cft_strg, "pause-message", NULL},
      {cft_strg, "init-code", NULL},
@@ -88,6 +92,7 @@ CONFIG cf_image[] =
      {cft_strg, "initrd", NULL},
      {cft_flag, "initrd-prompt", NULL},
      {cft_strg, "initrd-size", NULL},
+     {cft_strg, "sha256", NULL},
      {cft_flag, "pause-after", NULL},
      {cft_strg, "pause-message", NULL},
      {cft_flag, "novideo", NULL},
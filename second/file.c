@@ -173,6 +173,16 @@ extract_ipv4_args(char *imagepath, struct boot_fspec_t *result)
      result->bootp_retries = scopy(&str, &args);
      result->tftp_retries = scopy(&str, &args);
      result->subnetmask = is_valid_ipv4_str(scopy(&str, &args));
+     /* A blksize= is asked for with the other TFTP options */
+     tmp = strstr(args, "blksize=");
+     if (tmp && (tmp == args || tmp[-1] == ',')) {
+	  char *end = tmp + strlen("blksize=");
+
+	  result->blksize = scopy(&str, &end);
+	  if (tmp > args && !*end)
+	       tmp--;		/* the comma before it */
+	  memmove(tmp, end, strlen(end) + 1);
+     }
      if (*args) {
 	  result->addl_params = strdup(args);
 	  if (!result->addl_params)
@@ -571,6 +581,15 @@ file_block_open(	struct boot_file_t*	file,
      struct partition_t*	parts;
      struct partition_t*	p;
      struct partition_t*	found;
+     struct fs_mount_t*		mount;
+
+     /* Mounted already, no need to go through the partition map */
+     if (partition >= 0 &&
+	 (mount = fs_mount_lookup(fspec->dev, partition)) != NULL) {
+	  DEBUG_F("using %s mount of partition %d\n", mount->fs->name, partition);
+	  file->fs = fs_open(file, &mount->part, fspec);
+	  return fserrorno;
+     }
 
      parts = partitions_lookup(fspec->dev);
      found = NULL;
@@ -608,9 +627,6 @@ file_block_open(	struct boot_file_t*	file,
      file->fs = fs_open( file, found, fspec );
 
 done:
-     if (parts)
-	  partitions_free(parts);
-
      return fserrorno;
 }
 
@@ -655,8 +671,15 @@ static struct fs_t fs_default =
 };
 
 
+/* Scratch allocations made while opening a file, released on return.
+ * Driver state that must stay with the file is allocated by fs_open()
+ * in the long-lived arena.
+ */
+static struct arena open_arena = ARENA_INIT("open_file");
+
 int open_file(struct boot_fspec_t* spec, struct boot_file_t* file)
 {
+     struct arena *prev;
      int result;
 
      memset(file, 0, sizeof(struct boot_file_t*));
@@ -671,18 +694,26 @@ int open_file(struct boot_fspec_t* spec, struct boot_file_t* file)
      else
 	  return result;
 
+     prev = arena_enter(&open_arena);
      switch(file->device_kind) {
      case FILE_DEVICE_BLOCK:
 	  DEBUG_F("device is a block device\n");
-	  return file_block_open(file, spec, spec->part);
+	  result = file_block_open(file, spec, spec->part);
+	  break;
      case FILE_DEVICE_ISCSI:
 	  DEBUG_F("device is a iSCSI device\n");
-	  return file_block_open(file, spec, spec->part);
+	  result = file_block_open(file, spec, spec->part);
+	  break;
      case FILE_DEVICE_NET:
 	  DEBUG_F("device is a network device\n");
-	  return file_net_open(file, spec);
+	  result = file_net_open(file, spec);
+	  break;
+     default:
+	  result = 0;
      }
-     return 0;
+     arena_leave(prev);
+     arena_release(&open_arena);
+     return result;
 }
 
 /*
@@ -21,8 +21,11 @@
  */
 
 #include "stdlib.h"
+#include "string.h"
 #include "fs.h"
 #include "errors.h"
+#include "debug.h"
+#include "bootinfo.h"
 
 extern const struct fs_t	of_filesystem;
 extern const struct fs_t	of_net_filesystem;
@@ -57,18 +60,255 @@ static const struct fs_t *block_filesystems[] = {
 const struct fs_t *fs_of = &of_filesystem;              /* needed by ISO9660 */
 const struct fs_t *fs_of_netboot = &of_net_filesystem;  /* needed by file.c */
 
-const struct fs_t *
-fs_open(struct boot_file_t *file,
-	struct partition_t *part, struct boot_fspec_t *fspec)
+static struct fs_mount_t *mounts;
+
+/*
+ * Filesystem probe.  Rather than letting every driver open the disk and
+ * read its own superblock, the start of the partition is read once and
+ * the signatures are matched here.  The answer is remembered for each
+ * partition.
+ */
+
+/* Enough to reach the reiserfs superblock at 64k */
+#define PROBE_SIZE		0x20000
+
+#define EXT2_SB_MAGIC_OFFSET	(1024 + 56)
+#define REISERFS_MAGIC_OFFSET	52	/* s_magic in the superblock */
+
+struct fs_probe_t {
+     struct fs_probe_t*		next;
+     char*			dev;
+     int			part_number;
+     const struct fs_t*		fs;
+};
+
+static struct fs_probe_t *probes;
+
+static int
+probe_match(const unsigned char *buf, int len, int offset,
+	    const char *magic, int n)
+{
+     return offset + n <= len && !memcmp(buf + offset, magic, n);
+}
+
+static const struct fs_t *
+probe_buffer(const unsigned char *buf, int len)
+{
+     static const int swap_offsets[] = { 0xff6, 0xfff6 };	/* 4k, 64k pages */
+     int i;
+
+     for (i = 0; i < 2; i++)
+	  if (probe_match(buf, len, swap_offsets[i], "SWAP-SPACE", 10)
+	      || probe_match(buf, len, swap_offsets[i], "SWAPSPACE2", 10))
+	       return &swap_filesystem;
+
+     if (probe_match(buf, len, EXT2_SB_MAGIC_OFFSET, "\x53\xef", 2))
+	  return &ext2_filesystem;
+
+     if (probe_match(buf, len, 0, "XFSB", 4)) {
+#ifdef CONFIG_FS_XFS
+	  return &xfs_filesystem;
+#else
+	  return &of_filesystem;
+#endif /* CONFIG_FS_XFS */
+     }
+
+     /* Current reiserfs superblock at 64k, 3.5 - 3.5.11 ones at 8k */
+     if (probe_match(buf, len, 0x10000 + REISERFS_MAGIC_OFFSET, "ReIsEr", 6)
+	 || probe_match(buf, len, 0x2000 + REISERFS_MAGIC_OFFSET, "ReIsEr", 6)) {
+#ifdef CONFIG_FS_REISERFS
+	  return &reiserfs_filesystem;
+#else
+	  return &of_filesystem;
+#endif /* CONFIG_FS_REISERFS */
+     }
+
+     /* HFS/HFS+, ISO9660, UDF, UFS */
+     return &of_filesystem;
+}
+
+/* Find which driver handles part, NULL if it couldn't be determined */
+static const struct fs_t *
+fs_probe(struct boot_file_t *file, struct partition_t *part,
+	 struct boot_fspec_t *fspec)
+{
+     static char device_name[1024];
+     struct fs_probe_t *probe;
+     const struct fs_t *fs;
+     unsigned char *buf;
+     prom_handle dev;
+     int len;
+
+     if (!part || (file->device_kind != FILE_DEVICE_BLOCK
+		   && file->device_kind != FILE_DEVICE_ISCSI))
+	  return NULL;
+
+     for (probe = probes; probe; probe = probe->next)
+	  if (probe->part_number == part->part_number
+	      && !strcmp(probe->dev, fspec->dev))
+	       return probe->fs;
+
+     /* Don't read past the end of the partition */
+     len = PROBE_SIZE;
+     if (part->part_size && (unsigned long long)part->part_size * part->blocksize < len)
+	  len = part->part_size * part->blocksize;
+
+     buf = malloc(len);
+     if (!buf)
+	  return NULL;
+
+     strncpy(device_name, fspec->dev, 1020);
+     if (_machine != _MACH_bplan)
+	  strcat(device_name, ":0");
+     dev = prom_open(device_name);
+     if (!dev || dev == PROM_INVALID_HANDLE) {
+	  free(buf);
+	  return NULL;
+     }
+     if (prom_lseek(dev, (unsigned long long)part->part_start * part->blocksize))
+	  len = prom_read(dev, buf, len);
+     else
+	  len = -1;
+     prom_close(dev);
+
+     if (len < 2048) {
+	  DEBUG_F("probe read of %s,%d failed\n", fspec->dev, part->part_number);
+	  free(buf);
+	  return NULL;
+     }
+     fs = probe_buffer(buf, len);
+     free(buf);
+
+     DEBUG_F("%s,%d looks like %s\n", fspec->dev, part->part_number, fs->name);
+
+     probe = malloc(sizeof(struct fs_probe_t));
+     if (probe) {
+	  probe->dev = strdup(fspec->dev);
+	  probe->part_number = part->part_number;
+	  probe->fs = fs;
+	  probe->next = probes;
+	  if (probe->dev)
+	       probes = probe;
+     }
+     return fs;
+}
+
+static const struct fs_t *
+fs_open_driver(struct boot_file_t *file,
+	       struct partition_t *part, struct boot_fspec_t *fspec)
 {
      const struct fs_t **fs;
+     const struct fs_t *probed;
+     struct fs_mount_t *mount;
+
+     /* Already mounted, go straight to the right driver */
+     mount = fs_mount_lookup(fspec->dev, part ? part->part_number : -1);
+     if (mount) {
+	  fserrorno = mount->fs->open(file, part, fspec);
+	  return mount->fs;
+     }
+
+     probed = fs_probe(file, part, fspec);
+     if (probed == &swap_filesystem) {
+	  /* Keeps other drivers off swap space, see swap_open() */
+	  fserrorno = FILE_ERR_NOTFOUND;
+	  return probed;
+     }
+     if (probed) {
+	  if ((fserrorno = probed->open(file, part, fspec)) != FILE_ERR_BAD_FSYS)
+	       return probed;
+	  DEBUG_F("%s refused %s,%d\n", probed->name, fspec->dev, part->part_number);
+     }
+
+     /* Unknown, or the driver disagreed with the probe: try them all */
      for (fs = block_filesystems; *fs; fs++)
-	  if ((fserrorno = (*fs)->open(file, part, fspec)) != FILE_ERR_BAD_FSYS)
+	  if (*fs != probed
+	      && (fserrorno = (*fs)->open(file, part, fspec)) != FILE_ERR_BAD_FSYS)
 	       break;
 
      return *fs;
 }
 
+/* Mounts, probe results and whatever the drivers keep with them are
+ * allocated in the long-lived arena, they outlive the boot attempt.
+ */
+const struct fs_t *
+fs_open(struct boot_file_t *file,
+	struct partition_t *part, struct boot_fspec_t *fspec)
+{
+     struct arena *prev = arena_enter(&arena_long);
+     const struct fs_t *fs;
+
+     fs = fs_open_driver(file, part, fspec);
+     arena_leave(prev);
+     return fs;
+}
+
+struct fs_mount_t *
+fs_mount_lookup(const char *dev, int part_number)
+{
+     struct fs_mount_t *mount;
+
+     for (mount = mounts; mount; mount = mount->next)
+	  if (mount->part_number == part_number && !strcmp(mount->dev, dev))
+	       return mount;
+     return NULL;
+}
+
+/* Called by a driver once it has mounted a partition.  Returns NULL if
+ * the mount couldn't be recorded, the driver then has to tear it down
+ * itself when the file is closed.
+ */
+struct fs_mount_t *
+fs_mount_add(const char *dev, struct partition_t *part,
+	     const struct fs_t *fs, void *priv)
+{
+     struct fs_mount_t *mount;
+
+     mount = malloc(sizeof(struct fs_mount_t));
+     if (!mount)
+	  return NULL;
+     memset(mount, 0, sizeof(struct fs_mount_t));
+     mount->dev = strdup(dev);
+     if (!mount->dev) {
+	  free(mount);
+	  return NULL;
+     }
+     mount->part_number = -1;
+     if (part) {
+	  mount->part = *part;
+	  mount->part.next = NULL;
+	  mount->part_number = part->part_number;
+     }
+     mount->fs = fs;
+     mount->priv = priv;
+     mount->next = mounts;
+     mounts = mount;
+
+     DEBUG_F("mounted %s on %s,%d\n", fs->name, dev, mount->part_number);
+     return mount;
+}
+
+/* Drop every mount and close the devices, called before the kernel
+ * is entered or yaboot exits.
+ */
+void
+fs_umount_all(void)
+{
+     struct fs_mount_t *mount;
+
+     while ((mount = mounts) != NULL) {
+	  mounts = mount->next;
+	  DEBUG_F("unmounting %s on %s,%d\n", mount->fs->name,
+		  mount->dev, mount->part_number);
+	  if (mount->fs->umount)
+	       mount->fs->umount(mount);
+	  free(mount->dev);
+	  free(mount);
+     }
+     of_net_release();
+}
+
 /* 
  * Local variables:
  * c-file-style: "k&r"
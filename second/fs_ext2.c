@@ -35,10 +35,11 @@
 #include "fs.h"
 #include "errors.h"
 #include "debug.h"
+#include "bcache.h"
 #include "bootinfo.h"
+#include "byteorder.h"
 
 #define FAST_VERSION
-#define MAX_READ_RANGE	256
 #undef VERBOSE_DEBUG
 
 typedef int FILE;
@@ -55,6 +56,7 @@ static int ext2_seek(	struct boot_file_t*	file,
 			unsigned int		newpos);
 static int ext2_close(	struct boot_file_t*	file);
 static unsigned int ext2_ino_size(struct boot_file_t *file);
+static void ext2_umount(struct fs_mount_t *mount);
 
 struct fs_t ext2_filesystem =
 {
@@ -64,6 +66,7 @@ struct fs_t ext2_filesystem =
      ext2_seek,
      ext2_close,
      ext2_ino_size,
+     ext2_umount
 };
 
 /* IO manager structure for the ext2 library */
@@ -89,30 +92,36 @@ static struct struct_io_manager struct_linux_manager =
 
 static io_manager linux_io_manager = &struct_linux_manager;
 
-/* Currently, we have a mess between what is in the file structure
- * and what is stored globally here. I'll clean this up later
- */
-static int opened = 0;		/* We can't open twice ! */
-static unsigned int bs;		/* Blocksize */
-static unsigned long long doff;	/* Byte offset where partition starts */
-static unsigned long long dend;	/* Byte offset where partition ends */
+/* A run of logically and physically contiguous blocks of the open file */
+struct ext2_run {
+     unsigned long	lblk;		/* First logical block */
+     unsigned long long	pblk;		/* First physical block */
+     unsigned long	count;
+};
+
+/* Mounted filesystem state, one per partition in the mount table */
+struct ext2_mount {
+     ext2_filsys	fs;
+     unsigned int	bs;		/* Blocksize */
+     unsigned long long	doff;	/* Byte offset where partition starts */
+     unsigned long long	dend;	/* Byte offset where partition ends */
+     ihandle		of_device;
+     char*		block_buffer;
+     int		opened;		/* We can't open twice ! */
+     int		cached;		/* Recorded in the mount table */
+     struct ext2_run*	map;		/* Block map of the open file */
+     int		map_count;
+     int		map_alloc;
+     char*		path;		/* Extent tree node buffers */
+     unsigned long long	size;		/* Size of the open file */
+};
+
+/* The mount being worked on, the io manager below reads through it */
+static struct ext2_mount *mnt;
 static ino_t root,cwd;
-static ext2_filsys fs = 0;
-static struct boot_file_t* cur_file;
-static char *block_buffer = NULL;
 
 #ifdef FAST_VERSION
-static unsigned long read_range_start;
-static unsigned long read_range_count;
-static unsigned long read_last_logical;
-static unsigned long read_total;
-static unsigned long read_max;
-static struct boot_file_t* read_cur_file;
-static errcode_t read_result;
-static unsigned char* read_buffer;
-
-static int read_dump_range(void);
-static int read_iterator(ext2_filsys fs, blk_t *blocknr, int lg_block, void *private);
+static errcode_t ext2_map_file(struct ext2_mount *m, ino_t ino);
 #else /* FAST_VERSION */
 static struct ext2_inode cur_inode;
 #endif /* FAST_VERSION */
@@ -122,38 +131,47 @@ void com_err (const char *a, long i, const char *fmt,...)
      prom_printf ((char *) fmt);
 }
 
-static int
-ext2_open(	struct boot_file_t*	file,
-		struct partition_t*	part,
-		struct boot_fspec_t*	fspec)
+static void
+ext2_mount_free(struct ext2_mount *m)
 {
-     int result = 0;
-     int error = FILE_ERR_NOTFOUND;
+     if (m->fs)
+	  ext2fs_close(m->fs);
+     if (m->block_buffer)
+	  free(m->block_buffer);
+     if (m->map)
+	  free(m->map);
+     if (m->path)
+	  free(m->path);
+     bcache_invalidate(m->of_device);
+     prom_close(m->of_device);
+     free(m);
+}
+
+/* Find the mount of this partition, or mount it */
+static struct ext2_mount *
+ext2_mount(struct partition_t *part, struct boot_fspec_t *fspec, int *error)
+{
+     struct fs_mount_t *mount;
+     struct ext2_mount *m;
      static char buffer[1024];
-     int ofopened = 0;
-     char *dev_name = fspec->dev;
-     char *file_name = fspec->file;
+     int result;
 
-     DEBUG_ENTER;
-     DEBUG_OPEN;
+     mount = fs_mount_lookup(fspec->dev, part ? part->part_number : -1);
+     if (mount && mount->fs == &ext2_filesystem)
+	  return mount->priv;
 
-     if (opened) {
-	  DEBUG_LEAVE(FILE_ERR_FSBUSY);
-	  return FILE_ERR_FSBUSY;
-     }
-     if (file->device_kind != FILE_DEVICE_BLOCK
-         && file->device_kind != FILE_DEVICE_ISCSI) {
-	  DEBUG_LEAVE(FILE_ERR_BADDEV);
-	  return FILE_ERR_BADDEV;
+     m = malloc(sizeof(struct ext2_mount));
+     if (!m) {
+	  *error = FILE_ERR_NOMEM;
+	  return NULL;
      }
-
-     fs = NULL;
+     memset(m, 0, sizeof(struct ext2_mount));
 
      /* We don't care too much about the device block size since we run
       * thru the deblocker. We may have to change that is we plan to be
       * compatible with older versions of OF
       */
-     bs = 1024;
+     m->bs = 1024;
 
      /*
       * On the other hand, we do care about the actual size of the
@@ -162,65 +180,98 @@ ext2_open(	struct boot_file_t*	file,
       * read past the end of the lun takes ~30 secs to recover per
       * attempt.
       */
-     doff = dend = 0;
      if (part) {
-	  doff = (unsigned long long)(part->part_start) * part->blocksize;
-	  dend = doff + (unsigned long long)part->part_size * part->blocksize;
+	  m->doff = (unsigned long long)(part->part_start) * part->blocksize;
+	  m->dend = m->doff + (unsigned long long)part->part_size * part->blocksize;
      }
-     cur_file = file;
-
 
-     DEBUG_F("partition offset: %Lx, end: %Lx\n", doff, dend);
+     DEBUG_F("partition offset: %Lx, end: %Lx\n", m->doff, m->dend);
 
      /* Open the OF device for the entire disk */
-     strncpy(buffer, dev_name, 1020);
+     strncpy(buffer, fspec->dev, 1020);
      if (_machine != _MACH_bplan)
 	  strcat(buffer, ":0");
 
      DEBUG_F("<%s>\n", buffer);
 
-     file->of_device = prom_open(buffer);
+     m->of_device = prom_open(buffer);
 
-     DEBUG_F("file->of_device = %p\n", file->of_device);
+     DEBUG_F("of_device = %p\n", m->of_device);
 
-     if (file->of_device == PROM_INVALID_HANDLE) {
+     if (m->of_device == PROM_INVALID_HANDLE) {
 
-	  DEBUG_F("Can't open device %p\n", file->of_device);
-	  DEBUG_LEAVE(FILE_IOERR);
-	  return FILE_IOERR;
+	  DEBUG_F("Can't open device %p\n", m->of_device);
+	  free(m);
+	  *error = FILE_IOERR;
+	  return NULL;
      }
-     ofopened = 1;
 
      /* Open the ext2 filesystem */
-     result = ext2fs_open (buffer, EXT2_FLAG_RW, 0, 0, linux_io_manager, &fs);
+     mnt = m;
+     result = ext2fs_open (buffer, EXT2_FLAG_RW, 0, 0, linux_io_manager, &m->fs);
      if (result) {
 
 	  if(result == EXT2_ET_BAD_MAGIC)
 	  {
-	       DEBUG_F( "ext2fs_open returned bad magic loading file %p\n",
-			file );
+	       DEBUG_F( "ext2fs_open returned bad magic on %s\n", buffer );
 	  }
 	  else
 	  {
-	       DEBUG_F( "ext2fs_open error #%d while loading file %s\n",
-			result, file_name);
+	       DEBUG_F( "ext2fs_open error #%d on %s\n", result, buffer );
 	  }
-	  error = FILE_ERR_BAD_FSYS;
-	  goto bail;
+	  m->fs = NULL;
+	  ext2_mount_free(m);
+	  *error = FILE_ERR_BAD_FSYS;
+	  return NULL;
      }
 
      /* Allocate the block buffer */
-     block_buffer = malloc(fs->blocksize * 2);
-     if (!block_buffer) {
+     m->block_buffer = malloc(m->fs->blocksize * 2);
+     if (!m->block_buffer) {
 
-	  DEBUG_F("ext2fs: can't alloc block buffer (%d bytes)\n", fs->blocksize * 2);
-	  error = FILE_IOERR;
-	  goto bail;
+	  DEBUG_F("ext2fs: can't alloc block buffer (%d bytes)\n", m->fs->blocksize * 2);
+	  ext2_mount_free(m);
+	  *error = FILE_IOERR;
+	  return NULL;
      }
 
+     m->cached = fs_mount_add(fspec->dev, part, &ext2_filesystem, m) != NULL;
+     return m;
+}
+
+static int
+ext2_open(	struct boot_file_t*	file,
+		struct partition_t*	part,
+		struct boot_fspec_t*	fspec)
+{
+     int result = 0;
+     int error = FILE_ERR_NOTFOUND;
+     char *file_name = fspec->file;
+
+     DEBUG_ENTER;
+     DEBUG_OPEN;
+
+     if (file->device_kind != FILE_DEVICE_BLOCK
+         && file->device_kind != FILE_DEVICE_ISCSI) {
+	  DEBUG_LEAVE(FILE_ERR_BADDEV);
+	  return FILE_ERR_BADDEV;
+     }
+
+     mnt = ext2_mount(part, fspec, &error);
+     if (!mnt) {
+	  DEBUG_LEAVE_F(error);
+	  return error;
+     }
+     if (mnt->opened) {
+	  DEBUG_LEAVE(FILE_ERR_FSBUSY);
+	  return FILE_ERR_FSBUSY;
+     }
+     file->of_device = mnt->of_device;
+     file->priv = mnt;
+
      /* Lookup file by pathname */
      root = cwd = EXT2_ROOT_INO;
-     result = ext2fs_namei_follow(fs, root, cwd, file_name, &file->inode);
+     result = ext2fs_namei_follow(mnt->fs, root, cwd, file_name, &file->inode);
      if (result) {
 
 	  DEBUG_F("ext2fs_namei error #%d while loading file %s\n", result, file_name);
@@ -234,7 +285,7 @@ ext2_open(	struct boot_file_t*	file,
      }
 
 #if 0
-     result = ext2fs_follow_link(fs, root, cwd,  file->inode, &file->inode);
+     result = ext2fs_follow_link(mnt->fs, root, cwd,  file->inode, &file->inode);
      if (result) {
 
 	  DEBUG_F("ext2fs_follow_link error #%d while loading file %s\n", result, file_name);
@@ -244,7 +295,7 @@ ext2_open(	struct boot_file_t*	file,
 #endif
 
 #ifndef FAST_VERSION
-     result = ext2fs_read_inode(fs, file->inode, &cur_inode);
+     result = ext2fs_read_inode(mnt->fs, file->inode, &cur_inode);
      if (result) {
 
 	  DEBUG_F("ext2fs_read_inode error #%d while loading file %s\n", result, file_name);
@@ -258,21 +309,27 @@ ext2_open(	struct boot_file_t*	file,
 	       error = FILE_IOERR;
 	  goto bail;
      }
+#else /* FAST_VERSION */
+     result = ext2_map_file(mnt, file->inode);
+     if (result) {
+
+	  DEBUG_F("ext2_map_file error #%d while loading file %s\n", result, file_name);
+	  if (result == EXT2_ET_NO_MEMORY)
+	       error = FILE_ERR_NOMEM;
+	  else
+	       error = FILE_IOERR;
+	  goto bail;
+     }
 #endif /* FAST_VERSION */
      file->pos = 0;
 
-     opened = 1;
+     mnt->opened = 1;
 bail:
-     if (!opened) {
-	  if (fs)
-	       ext2fs_close(fs);
-	  fs = NULL;
-	  if (ofopened)
-	       prom_close(file->of_device);
-	  if (block_buffer)
-	       free(block_buffer);
-	  block_buffer = NULL;
-	  cur_file = NULL;
+     if (!mnt->opened) {
+	  if (!mnt->cached)
+	       ext2_mount_free(mnt);
+	  mnt = NULL;
+	  file->priv = NULL;
 
 	  DEBUG_LEAVE_F(error);
 	  return error;
@@ -284,161 +341,195 @@ bail:
 
 #ifdef FAST_VERSION
 
-static int
-read_dump_range(void)
+/*
+ * The block map of a file is built once at open time: natively from the
+ * ext4 extent tree when the inode has one, otherwise with a single
+ * ext2fs_block_iterate() pass over the indirect blocks.  Reads then look
+ * up the run covering file->pos with a binary search.
+ */
+
+#define EXT4_EXTENTS_FL		0x00080000 /* Inode uses extents */
+#define EXT4_EXT_MAGIC		0xf30a
+#define EXT4_EXT_INIT_MAX_LEN	32768	/* Longer extents are uninitialized */
+#define EXT4_EXT_MAX_DEPTH	5
+
+/* On-disk extent tree, little endian */
+struct ext4_extent_header {
+     __u16	eh_magic;
+     __u16	eh_entries;
+     __u16	eh_max;
+     __u16	eh_depth;
+     __u32	eh_generation;
+};
+
+struct ext4_extent_idx {
+     __u32	ei_block;		/* First logical block covered */
+     __u32	ei_leaf_lo;		/* Child node */
+     __u16	ei_leaf_hi;
+     __u16	ei_unused;
+};
+
+struct ext4_extent {
+     __u32	ee_block;		/* First logical block */
+     __u16	ee_len;
+     __u16	ee_start_hi;		/* First physical block */
+     __u32	ee_start_lo;
+};
+
+/* Append a run to the map, merging it with the previous one if contiguous */
+static errcode_t
+map_add(struct ext2_mount *m, unsigned long lblk, unsigned long long pblk,
+	unsigned long count)
 {
-     int count = read_range_count;
-     int size;
+     struct ext2_run *r;
 
-#ifdef VERBOSE_DEBUG
-     DEBUG_F("   dumping range: start: 0x%x count: 0x%x\n",
-	     read_range_count, read_range_start);
-#endif
-     /* Check if we need to handle a special case for the last block */
-     if ((count * bs) > read_max)
-	  count--;
-     if (count) {
-	  size = count * bs;
-	  read_result = io_channel_read_blk(fs->io, read_range_start, count, read_buffer);
-	  if (read_result)
-	       return BLOCK_ABORT;
-	  read_buffer += size;
-	  read_max -= size;
-	  read_total += size;
-	  read_cur_file->pos += size;
-	  read_range_count -= count;
-	  read_range_start += count;
-	  read_last_logical += count;
+     if (m->map_count) {
+	  r = &m->map[m->map_count - 1];
+	  if (r->lblk + r->count == lblk && r->pblk + r->count == pblk) {
+	       r->count += count;
+	       return 0;
+	  }
      }
-     /* Handle remaining block */
-     if (read_max && read_range_count) {
-	  read_result = io_channel_read_blk(fs->io, read_range_start, 1, block_buffer);
-	  if (read_result)
-	       return BLOCK_ABORT;
-	  memcpy(read_buffer, block_buffer, read_max);
-	  read_cur_file->pos += read_max;
-	  read_total += read_max;
-	  read_max = 0;
+     if (m->map_count == m->map_alloc) {
+	  int n = m->map_alloc ? m->map_alloc * 2 : 16;
+
+	  r = realloc(m->map, n * sizeof(struct ext2_run));
+	  if (!r)
+	       return EXT2_ET_NO_MEMORY;
+	  m->map = r;
+	  m->map_alloc = n;
      }
-     read_range_count = read_range_start = 0;
-
-     return (read_max == 0) ? BLOCK_ABORT : 0;
+     r = &m->map[m->map_count++];
+     r->lblk = lblk;
+     r->pblk = pblk;
+     r->count = count;
+     return 0;
 }
 
 static int
-read_iterator(ext2_filsys fs, blk_t *blocknr, int lg_block, void *private)
+map_iterator(ext2_filsys fs, blk_t *blocknr, int lg_block, void *private)
 {
-#ifdef VERBOSE_DEBUG
-     DEBUG_F("read_it: p_bloc: 0x%x, l_bloc: 0x%x, f_pos: 0x%x, rng_pos: 0x%x   ",
-	     *blocknr, lg_block, read_cur_file->pos, read_last_logical);
-#endif
-     if (lg_block < 0) {
-#ifdef VERBOSE_DEBUG
-	  DEBUG_F(" <skip lg>\n");
-#endif
-	  return 0;
-     }
+     errcode_t *result = private;
 
-     /* If we have not reached the start block yet, we skip */
-     if (lg_block < read_cur_file->pos / bs) {
-#ifdef VERBOSE_DEBUG
-	  DEBUG_F(" <skip pos>\n");
-#endif
+     /* Negative logical blocks are the indirect blocks themselves */
+     if (lg_block < 0 || !*blocknr)
 	  return 0;
-     }
+     *result = map_add(mnt, lg_block, *blocknr, 1);
+     return *result ? BLOCK_ABORT : 0;
+}
 
-     /* If block is contiguous to current range, just extend range,
-      * exit if we pass the remaining bytes count to read
-      */
-     if (read_range_start && read_range_count < MAX_READ_RANGE
-	 && (*blocknr == read_range_start + read_range_count)
-	 && (lg_block == read_last_logical + read_range_count)) {
-#ifdef VERBOSE_DEBUG
-	  DEBUG_F(" block in range\n");
-#endif
-	  ++read_range_count;
-	  return ((read_range_count * bs) >= read_max) ? BLOCK_ABORT : 0;
+/* Walk one extent tree node of len bytes, level is the depth from the root */
+static errcode_t
+map_extents(struct ext2_mount *m, char *node, int len, int level)
+{
+     struct ext4_extent_header *eh = (struct ext4_extent_header *)node;
+     int i, entries, depth;
+     errcode_t result;
+
+     entries = le16_to_cpu(eh->eh_entries);
+     depth = le16_to_cpu(eh->eh_depth);
+     if (le16_to_cpu(eh->eh_magic) != EXT4_EXT_MAGIC
+	 || sizeof(*eh) + entries * sizeof(struct ext4_extent) > len
+	 || level + depth > EXT4_EXT_MAX_DEPTH) {
+	  DEBUG_F("bad extent node at level %d\n", level);
+	  return EXT2_ET_BAD_BLOCK_NUM;
      }
 
-     /* Range doesn't match. Dump existing range */
-     if (read_range_start) {
-#ifdef VERBOSE_DEBUG
-	  DEBUG_F(" calling dump range \n");
-#endif
-	  if (read_dump_range())
-	       return BLOCK_ABORT;
-     }
+     if (depth == 0) {
+	  struct ext4_extent *ex = (struct ext4_extent *)(eh + 1);
 
-     /* Here we handle holes in the file */
-     if (lg_block && lg_block != read_last_logical) {
-	  unsigned long nzero;
-#ifdef VERBOSE_DEBUG
-	  DEBUG_F(" hole from lg_bloc 0x%x\n", read_last_logical);
-#endif
-	  if (read_cur_file->pos % bs) {
-	       int offset = read_cur_file->pos % bs;
-	       int size = bs - offset;
-	       if (size > read_max)
-		    size = read_max;
-	       memset(read_buffer, 0, size);
-	       read_max -= size;
-	       read_total += size;
-	       read_buffer += size;
-	       read_cur_file->pos += size;
-	       ++read_last_logical;
-	       if (read_max == 0)
-		    return BLOCK_ABORT;
+	  for (i = 0; i < entries; i++, ex++) {
+	       unsigned long count = le16_to_cpu(ex->ee_len);
+
+	       /* Uninitialized extents read back as zeroes, leave a hole */
+	       if (count > EXT4_EXT_INIT_MAX_LEN)
+		    continue;
+	       result = map_add(m, le32_to_cpu(ex->ee_block),
+				((unsigned long long)le16_to_cpu(ex->ee_start_hi) << 32)
+				| le32_to_cpu(ex->ee_start_lo), count);
+	       if (result)
+		    return result;
 	  }
-	  nzero = (lg_block - read_last_logical) * bs;
-	  if (nzero) {
-	       if (nzero > read_max)
-		    nzero = read_max;
-	       memset(read_buffer, 0, nzero);
-	       read_max -= nzero;
-	       read_total += nzero;
-	       read_buffer += nzero;
-	       read_cur_file->pos += nzero;
-	       if (read_max == 0)
-		    return BLOCK_ABORT;
+     } else {
+	  struct ext4_extent_idx *ix = (struct ext4_extent_idx *)(eh + 1);
+	  char *child = m->path + level * m->bs;
+
+	  for (i = 0; i < entries; i++, ix++) {
+	       if (ix->ei_leaf_hi) {
+		    DEBUG_F("extent node beyond 2^32 blocks\n");
+		    return EXT2_ET_BAD_BLOCK_NUM;
+	       }
+	       result = io_channel_read_blk(m->fs->io, le32_to_cpu(ix->ei_leaf_lo),
+					    1, child);
+	       if (!result)
+		    result = map_extents(m, child, m->bs, level + 1);
+	       if (result)
+		    return result;
 	  }
-	  read_last_logical = lg_block;
      }
+     return 0;
+}
 
-     /* If we are not aligned, handle that case */
-     if (read_cur_file->pos % bs) {
-	  int offset = read_cur_file->pos % bs;
-	  int size = bs - offset;
-#ifdef VERBOSE_DEBUG
-	  DEBUG_F(" handle unaligned start\n");
-#endif
-	  read_result = io_channel_read_blk(fs->io, *blocknr, 1, block_buffer);
-	  if (read_result)
-	       return BLOCK_ABORT;
-	  if (size > read_max)
-	       size = read_max;
-	  memcpy(read_buffer, block_buffer + offset, size);
-	  read_cur_file->pos += size;
-	  read_max -= size;
-	  read_total += size;
-	  read_buffer += size;
-	  read_last_logical = lg_block + 1;
-	  return (read_max == 0) ? BLOCK_ABORT : 0;
+static errcode_t
+ext2_map_file(struct ext2_mount *m, ino_t ino)
+{
+     ext2_filsys fs = m->fs;
+     unsigned long group, offset;
+     struct ext2_inode *raw;
+     errcode_t result;
+     __u32 i_block[EXT2_N_BLOCKS];
+
+     m->map_count = 0;
+
+     /* Read the raw inode, ext2fs_read_inode() would byteswap i_block */
+     group = (ino - 1) / fs->super->s_inodes_per_group;
+     if (group >= fs->group_desc_count)
+	  return EXT2_ET_BAD_INODE_NUM;
+     offset = ((ino - 1) % fs->super->s_inodes_per_group)
+	  * EXT2_INODE_SIZE(fs->super);
+     result = io_channel_read_blk(fs->io, fs->group_desc[group].bg_inode_table
+				  + offset / fs->blocksize, 1, m->block_buffer);
+     if (result)
+	  return result;
+     raw = (struct ext2_inode *)(m->block_buffer + offset % fs->blocksize);
+
+     m->size = le32_to_cpu(raw->i_size);
+     if (LINUX_S_ISREG(le16_to_cpu(raw->i_mode)))
+	  m->size |= (unsigned long long)le32_to_cpu(raw->i_size_high) << 32;
+
+     if (!(le32_to_cpu(raw->i_flags) & EXT4_EXTENTS_FL)) {
+	  result = 0;
+	  mnt = m;
+	  if (ext2fs_block_iterate(fs, ino, 0, 0, map_iterator, &result)
+	      && !result)
+	       result = EXT2_ET_BAD_BLOCK_NUM;
+	  return result;
      }
 
-     /* If there is still a physical block to add, then create a new range */
-     if (*blocknr) {
-#ifdef VERBOSE_DEBUG
-	  DEBUG_F(" new range\n");
-#endif
-	  read_range_start = *blocknr;
-	  read_range_count = 1;
-	  return (bs >= read_max) ? BLOCK_ABORT : 0;
+     if (!m->path) {
+	  m->path = malloc(EXT4_EXT_MAX_DEPTH * m->bs);
+	  if (!m->path)
+	       return EXT2_ET_NO_MEMORY;
      }
+     memcpy(i_block, raw->i_block, sizeof(i_block));
+     return map_extents(m, (char *)i_block, sizeof(i_block), 0);
+}
 
-#ifdef VERBOSE_DEBUG
-     DEBUG_F("\n");
-#endif
-     return 0;
+/* Find the run holding lblk, or the first one after it if lblk is a hole */
+static struct ext2_run *
+map_lookup(struct ext2_mount *m, unsigned long lblk)
+{
+     int lo = 0, hi = m->map_count;
+
+     while (lo < hi) {
+	  int mid = (lo + hi) / 2;
+
+	  if (m->map[mid].lblk + m->map[mid].count <= lblk)
+	       lo = mid + 1;
+	  else
+	       hi = mid;
+     }
+     return (lo < m->map_count) ? &m->map[lo] : NULL;
 }
 
 #endif /* FAST_VERSION */
@@ -448,46 +539,63 @@ ext2_read(	struct boot_file_t*	file,
 		unsigned int		size,
 		void*			buffer)
 {
-     errcode_t retval;
 
 #ifdef FAST_VERSION
-     if (!opened)
+     unsigned int read = 0;
+
+     mnt = file->priv;
+     if (!mnt || !mnt->opened)
 	  return FILE_IOERR;
 
 
      DEBUG_F("ext_read() from pos 0x%Lx, size: 0x%ux\n", file->pos, size);
 
-
-     read_cur_file = file;
-     read_range_start = 0;
-     read_range_count = 0;
-     read_last_logical = file->pos / bs;
-     read_total = 0;
-     read_max = size;
-     read_buffer = (unsigned char*)buffer;
-     read_result = 0;
-
-     retval = ext2fs_block_iterate(fs, file->inode, 0, 0, read_iterator, 0);
-     if (retval == BLOCK_ABORT)
-	  retval = read_result;
-     if (!retval && read_range_start) {
-#ifdef VERBOSE_DEBUG
-	  DEBUG_F("on exit: range_start is 0x%x, calling dump...\n",
-		  read_range_start);
-#endif
-	  read_dump_range();
-	  retval = read_result;
+     if (file->pos >= mnt->size)
+	  return 0;
+     if (size > mnt->size - file->pos)
+	  size = mnt->size - file->pos;
+
+     while (read < size) {
+	  unsigned long lblk = file->pos / mnt->bs;
+	  struct ext2_run *r = map_lookup(mnt, lblk);
+	  unsigned long long end;
+	  unsigned int count;
+
+	  if (!r || r->lblk > lblk) {
+	       /* Hole up to the next run or the end of the file */
+	       end = r ? (unsigned long long)r->lblk * mnt->bs : mnt->size;
+	       count = (end - file->pos > size - read) ? size - read : end - file->pos;
+	       memset(buffer, 0, count);
+	  } else {
+	       unsigned long long pos;
+
+	       end = (unsigned long long)(r->lblk + r->count) * mnt->bs;
+	       count = (end - file->pos > size - read) ? size - read : end - file->pos;
+	       pos = (r->pblk + (lblk - r->lblk)) * mnt->bs
+		    + file->pos % mnt->bs + mnt->doff;
+	       if (mnt->dend && pos + count > mnt->dend) {
+		    DEBUG_F("\nRead past partition end, pos=%Lx\n", pos);
+		    prom_printf("ext2: i/o error in read\n");
+		    return read;
+	       }
+	       prom_lseek(file->of_device, pos);
+	       if (prom_read(file->of_device, buffer, count) != count) {
+		    prom_printf("ext2: i/o error in read\n");
+		    return read;
+	       }
+	  }
+	  read += count;
+	  buffer += count;
+	  file->pos += count;
      }
-     if (retval)
-	  prom_printf ("ext2: i/o error %ld in read\n", (long) retval);
-
-     return read_total;
+     return read;
 
 #else /* FAST_VERSION */
      int status;
      unsigned int read = 0;
 
-     if (!opened)
+     mnt = file->priv;
+     if (!mnt || !mnt->opened)
 	  return FILE_IOERR;
 
 
@@ -495,36 +603,36 @@ ext2_read(	struct boot_file_t*	file,
 
 
      while(size) {
-	  blk_t fblock = file->pos / bs;
+	  blk_t fblock = file->pos / mnt->bs;
 	  blk_t pblock;
 	  unsigned int blkorig, s, b;
 
 	  pblock = 0;
-	  status = ext2fs_bmap(fs, file->inode, &cur_inode,
-			       block_buffer, 0, fblock, &pblock);
+	  status = ext2fs_bmap(mnt->fs, file->inode, &cur_inode,
+			       mnt->block_buffer, 0, fblock, &pblock);
 	  if (status) {
 
 	       DEBUG_F("ext2fs_bmap(fblock:%d) return: %d\n", fblock, status);
 	       return read;
 	  }
-	  blkorig = fblock * bs;
+	  blkorig = fblock * mnt->bs;
 	  b = file->pos - blkorig;
-	  s = ((bs - b) > size) ? size : (bs - b);
+	  s = ((mnt->bs - b) > size) ? size : (mnt->bs - b);
 	  if (pblock) {
 	       unsigned long long pos =
-		    ((unsigned long long)pblock) * (unsigned long long)bs;
-	       pos += doff;
+		    ((unsigned long long)pblock) * (unsigned long long)mnt->bs;
+	       pos += mnt->doff;
 	       prom_lseek(file->of_device, pos);
-	       status = prom_read(file->of_device, block_buffer, bs);
-	       if (status != bs) {
+	       status = prom_read(file->of_device, mnt->block_buffer, mnt->bs);
+	       if (status != mnt->bs) {
 		    prom_printf("ext2: io error in read, ex: %d, got: %d\n",
-				bs, status);
+				mnt->bs, status);
 		    return read;
 	       }
 	  } else
-	       memset(block_buffer, 0, bs);
+	       memset(mnt->block_buffer, 0, mnt->bs);
 
-	  memcpy(buffer, block_buffer + b, s);
+	  memcpy(buffer, mnt->block_buffer + b, s);
 	  read += s;
 	  size -= s;
 	  buffer += s;
@@ -538,43 +646,63 @@ static int
 ext2_seek(	struct boot_file_t*	file,
 		unsigned int		newpos)
 {
-     if (!opened)
+     struct ext2_mount *m = file->priv;
+
+     if (!m || !m->opened)
 	  return FILE_CANT_SEEK;
 
      file->pos = newpos;
      return FILE_ERR_OK;
 }
 
+/* The filesystem stays mounted, ext2_umount() tears it down */
 static int
 ext2_close(	struct boot_file_t*	file)
 {
-     if (!opened)
-	  return FILE_IOERR;
+     struct ext2_mount *m = file->priv;
 
-     if (block_buffer)
-	  free(block_buffer);
-     block_buffer = NULL;
-
-     if (fs)
-	  ext2fs_close(fs);
-     fs = NULL;
+     if (!m || !m->opened)
+	  return FILE_IOERR;
 
-     prom_close(file->of_device);
+     m->opened = 0;
+     if (!m->cached)
+	  ext2_mount_free(m);
+     if (mnt == m)
+	  mnt = NULL;
+     file->priv = NULL;
+     file->of_device = 0;
      DEBUG_F("ext2_close called\n");
 
-     opened = 0;
-
      return 0;
 }
 
 static unsigned int ext2_ino_size(struct boot_file_t *file)
 {
+#ifdef FAST_VERSION
+    mnt = file->priv;
+    if (!mnt || !mnt->opened)
+	return 0;
+
+    return mnt->size;
+#else /* FAST_VERSION */
     struct ext2_inode ei;
 
-    if (ext2fs_read_inode(fs, file->inode, &ei))
+    mnt = file->priv;
+    if (!mnt || ext2fs_read_inode(mnt->fs, file->inode, &ei))
 	return 0;
 
     return ei.i_size;
+#endif /* FAST_VERSION */
+}
+
+static void
+ext2_umount(struct fs_mount_t *mount)
+{
+     struct ext2_mount *m = mount->priv;
+
+     if (mnt == m)
+	  mnt = NULL;
+     ext2_mount_free(m);
 }
 
 static errcode_t linux_open (const char *name, int flags, io_channel * channel)
@@ -592,7 +720,7 @@ static errcode_t linux_open (const char *name, int flags, io_channel * channel)
      io->manager = linux_io_manager;
      io->name = (char *) malloc (strlen (name) + 1);
      strcpy (io->name, name);
-     io->block_size = bs;
+     io->block_size = mnt->bs;
      io->read_error = 0;
      io->write_error = 0;
      *channel = io;
@@ -608,11 +736,11 @@ static errcode_t linux_close (io_channel channel)
 
 static errcode_t linux_set_blksize (io_channel channel, int blksize)
 {
-     DEBUG_F("bs set to 0x%x\n", blksize);
-     channel->block_size = bs = blksize;
-     if (block_buffer) {
-	  free(block_buffer);
-	  block_buffer = malloc(bs * 2);
+     DEBUG_F("mnt->bs set to 0x%x\n", blksize);
+     channel->block_size = mnt->bs = blksize;
+     if (mnt->block_buffer) {
+	  free(mnt->block_buffer);
+	  mnt->block_buffer = malloc(mnt->bs * 2);
      }
      return 0;
 }
@@ -626,19 +754,18 @@ static errcode_t linux_read_blk (io_channel channel, unsigned long block, int co
 	  return 0;
 
      tempb = (((unsigned long long) block) *
-	      ((unsigned long long)bs)) + (unsigned long long)doff;
+	      ((unsigned long long)mnt->bs)) + (unsigned long long)mnt->doff;
      /*
-      * Only test tempb exceeding dend if dend is set to allow things
+      * Only test tempb exceeding mnt->dend if mnt->dend is set to allow things
       * like boot: hd:0,\xxxx
       */
-     if (dend && tempb > dend) {
+     if (mnt->dend && tempb > mnt->dend) {
 	  DEBUG_F("\nSeek error on block %lx, tempb=%Lx\n", block, tempb >> 9);
 	  return EXT2_ET_LLSEEK_FAILED;
      }
 
-     size = (count < 0) ? -count : count * bs;
-     prom_lseek(cur_file->of_device, tempb);
-     if (prom_read(cur_file->of_device, data, size) != size) {
+     size = (count < 0) ? -count : count * mnt->bs;
+     if (bcache_read(mnt->of_device, tempb, data, size) != size) {
 	  DEBUG_F("\nRead error on block %ld\n", block);
 	  return EXT2_ET_SHORT_READ;
      }
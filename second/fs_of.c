@@ -44,13 +44,19 @@
 #include "errors.h"
 #include "debug.h"
 
+/* Smallest TFTP buffer for a big file, the historical fixed size */
 #define LOAD_BUFFER_SIZE	0x1800000
+/* First buffer for a file of unknown size, config files fit in it */
+#define NET_SMALL_BUFFER	0x40000
+/* A size manifest is a decimal number, anything longer isn't one */
+#define NET_MANIFEST_MAX	32
 
 static int of_open(struct boot_file_t* file,
 		   struct partition_t* part, struct boot_fspec_t* fspec);
 static int of_read(struct boot_file_t* file, unsigned int size, void* buffer);
 static int of_seek(struct boot_file_t* file, unsigned int newpos);
 static int of_close(struct boot_file_t* file);
+static unsigned int of_ino_size(struct boot_file_t* file);
 
 
 static int of_net_open(struct boot_file_t* file,
@@ -58,15 +64,98 @@ static int of_net_open(struct boot_file_t* file,
 static int of_net_read(struct boot_file_t* file, unsigned int size, void* buffer);
 static int of_net_seek(struct boot_file_t* file, unsigned int newpos);
 static unsigned int of_net_ino_size(struct boot_file_t* file);
+static int of_net_load(struct boot_file_t* file, void* addr);
+static int of_net_close(struct boot_file_t* file);
 
 
+/* A small download buffer is shared by the files read through the
+ * network driver, claimed on first use and kept until of_net_release().
+ * Bigger ones, and one for a second file open at the same time, are
+ * given back when the file is closed.
+ */
+static unsigned char *net_buffer;
+static int net_buffer_busy;
+
+/* What an open network file keeps in file->priv */
+struct net_file {
+     char		*path;		/* OF path the file was opened by */
+     char		*plain;		/* the same without our TFTP options */
+     char		*size_path;	/* the one for its size manifest */
+     unsigned int	size;		/* from the manifest, 0 if unknown */
+     int		size_read;
+     int		plain_only;	/* options refused for this file */
+};
+
+/* OF paths whose download failed, they are not tried again */
+struct net_miss {
+     struct net_miss	*next;
+     char		*path;
+};
+
+static struct net_miss *net_misses;
+
+/* TFTP options from yaboot.conf, until the server turns them down.
+ * That is taken to be the case when a download with them fails but
+ * works without them, twice, before any download with them worked.
+ * Files that fail both ways are just missing; after a couple of those
+ * and no refusal the options are taken to be fine.
+ */
+#define TFTP_REFUSALS	2
+#define TFTP_PROBES	2
+
+static char *tftp_blksize;
+static char *tftp_windowsize;
+static int tftp_options_worked;
+static int tftp_options_refused;
+static int tftp_options_probed;
+
+void
+of_net_tftp_options(char *blksize, char *windowsize)
+{
+     tftp_blksize = blksize;
+     tftp_windowsize = windowsize;
+}
+
+static int
+of_net_missed(const char *path)
+{
+     struct net_miss *m;
+
+     for (m = net_misses; m; m = m->next)
+	  if (!strcmp(m->path, path))
+	       return 1;
+     return 0;
+}
+
+static void
+of_net_miss(const char *path)
+{
+     struct arena *prev;
+     struct net_miss *m;
+
+     if (of_net_missed(path))
+	  return;
+     prev = arena_enter(&arena_long);
+     m = malloc(sizeof(struct net_miss));
+     if (m) {
+	  m->path = strdup(path);
+	  m->next = net_misses;
+	  if (m->path)
+	       net_misses = m;
+	  else
+	       free(m);
+     }
+     arena_leave(prev);
+}
+
 struct fs_t of_filesystem =
 {
      "built-in",
      of_open,
      of_read,
      of_seek,
-     of_close
+     of_close,
+     of_ino_size,
 };
 
 struct fs_t of_net_filesystem =
@@ -75,8 +164,10 @@ struct fs_t of_net_filesystem =
      of_net_open,
      of_net_read,
      of_net_seek,
-     of_close,
+     of_net_close,
      of_net_ino_size,
+     NULL,
+     of_net_load,
 };
 
 static int
@@ -132,29 +223,83 @@ of_open(struct boot_file_t* file,
      return FILE_ERR_OK;
 }
 
+/* Ask for a bigger block and window size, as keyword arguments at the
+ * end.  A blksize= from the boot path takes precedence over the one in
+ * yaboot.conf.  Returns 1 if anything was added. */
 static int
-of_net_open(struct boot_file_t* file,
-	    struct partition_t* part, struct boot_fspec_t* fspec)
+of_net_add_options(char *buffer, struct boot_fspec_t* fspec)
 {
-     static char	buffer[1024];
-     char               *filename = NULL;
-     char               *p;
-     int                new_tftp;
-
-     DEBUG_ENTER;
-     DEBUG_OPEN;
+     char *blksize = fspec->blksize ? fspec->blksize : tftp_blksize;
+     int len = strlen(buffer);
+
+     if (tftp_options_refused >= TFTP_REFUSALS)
+	  return 0;
+     if (blksize && *blksize && strlen(buffer) + strlen(blksize) < 1000) {
+	  strcat(buffer, ",blksize=");
+	  strcat(buffer, blksize);
+     }
+     if (tftp_windowsize && *tftp_windowsize
+	 && strlen(buffer) + strlen(tftp_windowsize) < 1000) {
+	  strcat(buffer, ",windowsize=");
+	  strcat(buffer, tftp_windowsize);
+     }
+     return strlen(buffer) != len;
+}
 
-     if (fspec->file && strlen(fspec->file)) {
-	  filename = strdup(fspec->file);
-	  for (p = filename; *p; p++)
-	       if (*p == '/')
-		    *p = '\\';
+/* Download from *dev, opened by net->path, into buf.  If that fails
+ * and TFTP options were asked for, the server may not negotiate them:
+ * try again on a device opened without, until we know better.
+ */
+static int
+of_net_loadmethod(prom_handle *dev, struct net_file *net, void* buf)
+{
+     prom_handle plain_dev;
+     int len;
+
+     len = prom_loadmethod(*dev, buf);
+     if (!net->plain || net->plain_only)
+	  return len;
+     if (len > 0) {
+	  tftp_options_worked = 1;
+	  return len;
+     }
+     if (tftp_options_worked
+	 || (!tftp_options_refused && tftp_options_probed >= TFTP_PROBES))
+	  return len;
+
+     DEBUG_F("retrying without TFTP options: \"%s\"\n", net->plain);
+     plain_dev = prom_open(net->plain);
+     if (plain_dev == PROM_INVALID_HANDLE || plain_dev == 0)
+	  return len;
+     len = prom_loadmethod(plain_dev, buf);
+     if (len <= 0) {
+	  /* Not there, nothing to do with the options */
+	  prom_close(plain_dev);
+	  tftp_options_probed++;
+	  return len;
      }
 
-     DEBUG_F("siaddr <%s>; filename <%s>; ciaddr <%s>; giaddr <%s>;"
-             " ipv6 <%d>\n",
-             fspec->siaddr, filename, fspec->ciaddr, fspec->giaddr,
-             fspec->is_ipv6);
+     prom_close(*dev);
+     *dev = plain_dev;
+     net->plain_only = 1;
+     if (++tftp_options_refused == TFTP_REFUSALS)
+	  prom_printf("TFTP server refused blksize/windowsize, not using them\n");
+     return len;
+}
+
+/* Open the file again for a fresh download */
+static prom_handle
+of_net_reopen(struct net_file *net)
+{
+     return prom_open(net->plain_only ? net->plain : net->path);
+}
+
+/* Build the OF path to download filename from into buffer, without
+ * the TFTP options.  Returns 1 if the firmware's TFTP takes options. */
+static int
+of_net_path(char *buffer, struct boot_fspec_t* fspec, const char *filename)
+{
+     int                new_tftp;
 
      strncpy(buffer, fspec->dev, 768);
      /* If we didn't get a ':' include one */
@@ -192,9 +337,60 @@ of_net_open(struct boot_file_t* file,
           strcat(buffer, ",");
           strcat(buffer, filename);
      }
+     return new_tftp;
+}
+
+static int
+of_net_open(struct boot_file_t* file,
+	    struct partition_t* part, struct boot_fspec_t* fspec)
+{
+     static char	buffer[1024];
+     static char	plain_buffer[1024];
+     static char	size_buffer[1024];
+     static char	size_name[264];
+     char               *filename = NULL;
+     char               *p;
+     struct net_file    *net;
+     struct arena       *prev;
+     int                options = 0;
+
+     DEBUG_ENTER;
+     DEBUG_OPEN;
+
+     if (fspec->file && strlen(fspec->file)) {
+	  filename = strdup(fspec->file);
+	  for (p = filename; *p; p++)
+	       if (*p == '/')
+		    *p = '\\';
+     }
+
+     DEBUG_F("siaddr <%s>; filename <%s>; ciaddr <%s>; giaddr <%s>;"
+             " ipv6 <%d>\n",
+             fspec->siaddr, filename, fspec->ciaddr, fspec->giaddr,
+             fspec->is_ipv6);
+
+     if (of_net_path(buffer, fspec, filename)) {
+	  strcpy(plain_buffer, buffer);
+	  options = of_net_add_options(buffer, fspec);
+     }
+     /* The manifest is only looked for when the file is loaded whole or
+      * its size asked for, for the kernel and ramdisk */
+     size_buffer[0] = 0;
+     if (filename && strlen(filename) < 256) {
+	  strcpy(size_name, filename);
+	  strcat(size_name, ".size");
+	  of_net_path(size_buffer, fspec, size_name);
+     }
 
      DEBUG_F("Opening: \"%s\"\n", buffer);
 
+     file->priv = NULL;
+     if (of_net_missed(buffer)) {
+	  DEBUG_F("failed before, not trying again\n");
+	  DEBUG_LEAVE(FILE_ERR_NOTFOUND);
+	  return FILE_ERR_NOTFOUND;
+     }
+
      file->of_device = prom_open(buffer);
 
      DEBUG_F("file->of_device = %p\n", file->of_device);
@@ -207,22 +403,279 @@ of_net_open(struct boot_file_t* file,
      }
 
 
-     file->buffer = prom_claim_chunk_top(LOAD_BUFFER_SIZE, 0);
-     if (file->buffer == (void *)-1) {
-	  prom_printf("Can't claim memory for TFTP download\n");
+     /* Nothing is transferred until the file is read, or loaded in
+      * place with of_net_load() */
+     file->buffer = NULL;
+     file->buffer_size = 0;
+     file->len = 0;
+
+     /* The paths are kept to remember a failed download by */
+     prev = arena_enter(&arena_long);
+     net = malloc(sizeof(struct net_file));
+     if (net) {
+	  memset(net, 0, sizeof(struct net_file));
+	  net->path = strdup(buffer);
+	  if (options)
+	       net->plain = strdup(plain_buffer);
+	  if (size_buffer[0])
+	       net->size_path = strdup(size_buffer);
+     }
+     arena_leave(prev);
+     if (!net || !net->path || (options && !net->plain)) {
+	  if (net) {
+	       if (net->path)
+		    free(net->path);
+	       if (net->size_path)
+		    free(net->size_path);
+	       free(net);
+	  }
+	  prom_close(file->of_device);
+	  DEBUG_LEAVE(FILE_ERR_NOMEM);
+	  return FILE_ERR_NOMEM;
+     }
+     file->priv = net;
+
+     DEBUG_LEAVE(FILE_ERR_OK);
+     return FILE_ERR_OK;
+}
+
+/* A download buffer of at least want bytes: the shared small one if
+ * that is enough and free, else one of its own.  NULL if there is no
+ * memory for it.
+ */
+static void *
+of_net_buffer_get(unsigned int want, unsigned int *size)
+{
+     void *buf;
+
+     if (want <= NET_SMALL_BUFFER) {
+	  if (net_buffer && !net_buffer_busy) {
+	       net_buffer_busy = 1;
+	       *size = NET_SMALL_BUFFER;
+	       return net_buffer;
+	  }
+	  want = NET_SMALL_BUFFER;
+     }
+     *size = (want + 0xfff) & ~0xfff;
+     buf = prom_claim_chunk_top(*size, 0);
+     if (buf == (void *)-1)
+	  return NULL;
+     DEBUG_F("TFTP buffer 0x%x bytes at %p\n", *size, buf);
+     if (!net_buffer && *size == NET_SMALL_BUFFER) {
+	  net_buffer = buf;
+	  net_buffer_busy = 1;
+     }
+     return buf;
+}
+
+static void
+of_net_buffer_put(void *buf, unsigned int size)
+{
+     if (buf == net_buffer)
+	  net_buffer_busy = 0;
+     else
+	  prom_release(buf, size);
+}
+
+/* The buffer to try after one of size bytes filled up */
+static unsigned int
+of_net_buffer_grow(unsigned int size)
+{
+     unsigned int big;
+
+     if (size > NET_SMALL_BUFFER)
+	  return size * 2;
+
+     /* Not a small file after all.  "load" has no length argument so
+      * the buffer has to hold anything the server may send.  Take half
+      * the largest free range, leaving the other half for whatever the
+      * file gets copied to.
+      */
+     big = (prom_largest_free() / 2) & ~0xfffUL;
+     return big > LOAD_BUFFER_SIZE ? big : LOAD_BUFFER_SIZE;
+}
+
+/* The file size from its manifest, "<file>.size" next to it on the
+ * server holding the length in decimal.  The firmware doesn't pass on
+ * the TFTP tsize, so this is the only way to know it before the
+ * download.  0 if there is no manifest.  It is fetched into a claimed
+ * download buffer like any small file, never into our own image.
+ */
+static unsigned int
+of_net_manifest(struct net_file *net)
+{
+     unsigned int size;
+     prom_handle dev;
+     char *buf;
+     long n;
+     int len;
+
+     if (net->size_read)
+	  return net->size;
+     net->size_read = 1;
+     if (!net->size_path || of_net_missed(net->size_path))
+	  return 0;
+
+     dev = prom_open(net->size_path);
+     if (dev == PROM_INVALID_HANDLE || dev == 0)
+	  return 0;
+     buf = of_net_buffer_get(0, &size);
+     if (!buf) {
+	  prom_close(dev);
+	  return 0;
+     }
+     len = prom_loadmethod(dev, buf);
+     if (len > 0 && len < NET_MANIFEST_MAX) {
+	  buf[len] = 0;
+	  n = strtol(buf, NULL, 10);
+	  if (n > 0)
+	       net->size = n;
+     } else
+	  of_net_miss(net->size_path);
+     of_net_buffer_put(buf, size);
+     prom_close(dev);
+
+     DEBUG_F("size manifest: %u\n", net->size);
+     return net->size;
+}
+
+/* The file came in at len bytes and the manifest said otherwise.  It
+ * is out of date: forget it, here and for the next open, and fail the
+ * load rather than boot a file cut to the wrong size.
+ */
+static void
+of_net_manifest_wrong(struct net_file *net, int len)
+{
+     prom_printf("%s: %d bytes, the size manifest says %u\n",
+		 net->path, len, net->size);
+     net->size = 0;
+     net->size_read = 1;
+     of_net_miss(net->size_path);
+}
+
+/* Room to load a file of len bytes in, with a page to spare so that a
+ * complete download can be told from one cut off at the end */
+#define NET_ROOM(len)	(((len) + 0x1fff) & ~0xfff)
+
+/* TFTP the file into a buffer of our own, unless that's done already.
+ * That is sized from the manifest if it was read, else small.  If the
+ * file fills the buffer it may not have fit, and is fetched again into
+ * a bigger one while there is memory for it.  A file that doesn't match
+ * its manifest is an error.
+ */
+static int
+of_net_fetch(struct boot_file_t* file)
+{
+     struct net_file *net = file->priv;
+     unsigned int want = 0, size;
+     prom_handle dev;
+     void *buf;
+     int len;
+
+     if (file->buffer)
+	  return FILE_ERR_OK;
+
+     if (net->size)
+	  want = NET_ROOM(net->size);
+     for (;;) {
+	  buf = of_net_buffer_get(want, &size);
+	  if (!buf) {
+	       prom_printf("Can't claim memory for TFTP download\n");
+	       return FILE_IOERR;
+	  }
+	  len = of_net_loadmethod(&file->of_device, net, buf);
+	  DEBUG_F("result: %d\n", len);
+	  if (len < 0 || (unsigned int)len < size)
+	       break;
+
+	  /* Start over on a fresh device, the transfer is done with */
+	  of_net_buffer_put(buf, size);
+	  dev = of_net_reopen(net);
+	  if (dev == PROM_INVALID_HANDLE || dev == 0) {
+	       prom_printf("Can't reopen %s\n", net->path);
+	       return FILE_IOERR;
+	  }
 	  prom_close(file->of_device);
-	  DEBUG_LEAVE(FILE_IOERR);
+	  file->of_device = dev;
+	  want = of_net_buffer_grow(size);
+	  DEBUG_F("buffer full, trying again with 0x%x bytes\n", want);
+     }
+     if (len > 0 && net->size && net->size != len) {
+	  of_net_manifest_wrong(net, len);
+	  of_net_buffer_put(buf, size);
 	  return FILE_IOERR;
      }
-     memset(file->buffer, 0, LOAD_BUFFER_SIZE);
+     file->buffer = buf;
+     file->buffer_size = size;
 
-     DEBUG_F("TFP...\n");
+     if (len <= 0) {
+	  of_net_miss(net->path);
+	  len = 0;
+     }
+     file->len = len;
+     return FILE_ERR_OK;
+}
 
-     file->len = prom_loadmethod(file->of_device, file->buffer);
+/* Load the whole file at the first free address from addr on, so the
+ * caller can use it where it lies instead of reading it out of our
+ * buffer.  "load" can't be told to stop, so the memory is claimed to
+ * the end of a free range, one that holds the size from the manifest
+ * if there is one, and the unused tail given back once the size is
+ * known.  A file that fills all of it may not have fit: FILE_ERR_NOMEM
+ * then, as when nothing could be claimed, and the caller reads it
+ * through of_net_fetch().  One that doesn't match its manifest fails.
+ */
+static int
+of_net_load(struct boot_file_t* file, void* addr)
+{
+     struct net_file *net = file->priv;
+     unsigned int size, used;
+     int len;
 
-     DEBUG_F("result: %Ld\n", file->len);
+     if (file->buffer)
+	  return FILE_IOERR;
 
-     DEBUG_LEAVE(FILE_ERR_OK);
+     /* Nothing of ours should be in the way of the kernel and ramdisk,
+      * the manifest's buffer included */
+     of_net_manifest(net);
+     of_net_release();
+     file->buffer = prom_claim_rest(addr, net->size ? NET_ROOM(net->size)
+				    : LOAD_BUFFER_SIZE, &size);
+     if (file->buffer == (void *)-1) {
+	  file->buffer = NULL;
+	  return FILE_ERR_NOMEM;
+     }
+
+     len = of_net_loadmethod(&file->of_device, net, file->buffer);
+     DEBUG_F("loaded %d bytes at %p\n", len, file->buffer);
+
+     if (len > 0 && net->size && net->size != len) {
+	  of_net_manifest_wrong(net, len);
+	  prom_release(file->buffer, size);
+	  file->buffer = NULL;
+	  return FILE_IOERR;
+     }
+     if (len > 0 && (unsigned int)len >= size) {
+	  DEBUG_F("0x%x bytes at %p weren't enough\n", size, file->buffer);
+	  prom_release(file->buffer, size);
+	  file->buffer = NULL;
+	  prom_close(file->of_device);
+	  file->of_device = of_net_reopen(net);
+	  if (file->of_device == PROM_INVALID_HANDLE || file->of_device == 0)
+	       return FILE_IOERR;
+	  return FILE_ERR_NOMEM;
+     }
+
+     used = len > 0 ? (len + 0xfff) & ~0xfff : 0;
+     if (used < size)
+	  prom_release(file->buffer + used, size - used);
+     if (!used) {
+	  of_net_miss(net->path);
+	  file->buffer = NULL;
+	  return FILE_ERR_NOTFOUND;
+     }
+     file->buffer_size = used;
+     file->len = len;
      return FILE_ERR_OK;
 }
 
@@ -241,6 +694,8 @@ of_net_read(struct boot_file_t* file, unsigned int size, void* buffer)
 {
      unsigned int count, av;
 
+     if (of_net_fetch(file) != FILE_ERR_OK)
+	  return FILE_IOERR;
      av = file->len - file->pos;
      count = size > av ? av : size;
      memcpy(buffer, file->buffer + file->pos, count);
@@ -262,6 +717,8 @@ of_seek(struct boot_file_t* file, unsigned int newpos)
 static int
 of_net_seek(struct boot_file_t* file, unsigned int newpos)
 {
+     if (of_net_fetch(file) != FILE_ERR_OK)
+	  return FILE_CANT_SEEK;
      file->pos = (newpos > file->len) ? file->len : newpos;
      return FILE_ERR_OK;
 }
@@ -274,7 +731,7 @@ of_close(struct boot_file_t* file)
      DEBUG_F("<@%p>\n", file->of_device);
 
      if (file->buffer) {
-	  prom_release(file->buffer, LOAD_BUFFER_SIZE);
+	  prom_release(file->buffer, file->buffer_size);
      }
      prom_close(file->of_device);
      DEBUG_F("of_close called\n");
@@ -283,10 +740,62 @@ of_close(struct boot_file_t* file)
      return 0;
 }
 
+/* File packages that implement "size" report it, others give 0 */
+static unsigned int
+of_ino_size(struct boot_file_t* file)
+{
+     unsigned long long size = prom_getsize(file->of_device);
+
+     return size > 0xffffffffULL ? 0 : size;
+}
+
+static int
+of_net_close(struct boot_file_t* file)
+{
+     struct net_file *net;
+
+     DEBUG_ENTER;
+     DEBUG_F("<@%p>\n", file->of_device);
+
+     if (file->buffer)
+	  of_net_buffer_put(file->buffer, file->buffer_size);
+     file->buffer = NULL;
+     if (file->priv) {
+	  net = file->priv;
+	  free(net->path);
+	  if (net->plain)
+	       free(net->plain);
+	  if (net->size_path)
+	       free(net->size_path);
+	  free(net);
+	  file->priv = NULL;
+     }
+     prom_close(file->of_device);
+
+     DEBUG_LEAVE(0);
+     return 0;
+}
+
+/* Give the shared download buffer back, before entering the kernel */
+void
+of_net_release(void)
+{
+     if (net_buffer && !net_buffer_busy) {
+	  prom_release(net_buffer, NET_SMALL_BUFFER);
+	  net_buffer = NULL;
+     }
+}
+
+/* Known without downloading the file if it has a size manifest, but
+ * once it is here its real length counts */
 static unsigned int
 of_net_ino_size(struct boot_file_t* file)
 {
-	return file->len;
+     if (!file->buffer && of_net_manifest(file->priv))
+	  return ((struct net_file *)file->priv)->size;
+     if (of_net_fetch(file) != FILE_ERR_OK)
+	  return 0;
+     return file->len;
 }
 
 /*
@@ -29,6 +29,7 @@
 #include "fs.h"
 #include "errors.h"
 #include "debug.h"
+#include "bcache.h"
 #include "bootinfo.h"
 #include "reiserfs/reiserfs.h"
 
@@ -40,13 +41,17 @@ static int reiserfs_read( struct boot_file_t *file, unsigned int size,
 			  void *buffer );
 static int reiserfs_seek( struct boot_file_t *file, unsigned int newpos );
 static int reiserfs_close( struct boot_file_t *file );
+static unsigned int reiserfs_ino_size( struct boot_file_t *file );
+static void reiserfs_umount( struct fs_mount_t *mount );
 
 struct fs_t reiserfs_filesystem = {
      name:"reiserfs",
      open:reiserfs_open,
      read:reiserfs_read,
      seek:reiserfs_seek,
-     close:reiserfs_close
+     close:reiserfs_close,
+     ino_size:reiserfs_ino_size,
+     umount:reiserfs_umount
 };
 
 static int reiserfs_read_super( void );
@@ -54,29 +59,65 @@ static int reiserfs_open_file( char *dirname );
 static int reiserfs_read_data( char *buf, __u32 len );
 
 
-static struct reiserfs_state reiserfs;
-static struct reiserfs_state *INFO = &reiserfs;
+/* Mounted filesystem state, one per partition in the mount table.  The
+ * tree node cache in buf and the journal map live as long as the mount.
+ */
+struct reiserfs_mount
+{
+     struct reiserfs_state state;
+     ihandle of_device;
+     int cached;
+     char buf[FSYSREISER_BUF_SIZE];
+};
+
+/* The mount being worked on */
+static struct reiserfs_state *INFO;
 
 /* Adapted from GRUB: */
-static char FSYS_BUF[FSYSREISER_CACHE_SIZE];
+static char *FSYS_BUF;
 int errnum;
 
+static void
+reiserfs_use( struct reiserfs_mount *m )
+{
+     INFO = &m->state;
+     FSYS_BUF = m->buf;
+}
 
-static int
-reiserfs_open( struct boot_file_t *file, struct partition_t *part,
-		struct boot_fspec_t *fspec)
+static void
+reiserfs_mount_free( struct reiserfs_mount *m )
+{
+     if ( m->state.journal_map )
+	  free( m->state.journal_map );
+     bcache_invalidate( m->of_device );
+     prom_close( m->of_device );
+     free( m );
+}
+
+/* Find the mount of this partition, or mount it */
+static struct reiserfs_mount *
+reiserfs_mount( struct boot_file_t *file, struct partition_t *part,
+		struct boot_fspec_t *fspec, int *error )
 {
      static char buffer[1024];
-     char *dev_name = fspec->dev;
-     char *file_name = fspec->file;
+     struct fs_mount_t *mount;
+     struct reiserfs_mount *m;
 
-     DEBUG_ENTER;
-     DEBUG_OPEN;
+     mount = fs_mount_lookup( fspec->dev, part ? part->part_number : -1 );
+     if ( mount && mount->fs == &reiserfs_filesystem )
+	  return mount->priv;
 
-     memset( INFO, 0, sizeof(struct reiserfs_state) );
+     m = malloc( sizeof(struct reiserfs_mount) );
+     if ( !m )
+     {
+	  *error = FILE_ERR_NOMEM;
+	  return NULL;
+     }
+     memset( &m->state, 0, sizeof(struct reiserfs_state) );
+     reiserfs_use( m );
      INFO->file = file;
 
-     if (fspec->part)
+     if ( part )
      {
 	  DEBUG_F( "Determining offset for partition %d\n", part->part_number );
 	  INFO->partition_offset = ((uint64_t)part->part_start) * part->blocksize;
@@ -87,37 +128,65 @@ reiserfs_open( struct boot_file_t *file, struct partition_t *part,
      else
 	  INFO->partition_offset = 0;
 
-     strncpy(buffer, dev_name, 1020);
+     strncpy(buffer, fspec->dev, 1020);
      if (_machine != _MACH_bplan)
 	  strcat(buffer, ":0");  /* 0 is full disk in (non-buggy) OF */
 
-     file->of_device = prom_open( buffer );
+     m->of_device = file->of_device = prom_open( buffer );
      DEBUG_F( "Trying to open dev_name=%s; filename=%s; partition offset=%Lu\n",
-	      buffer, file_name, INFO->partition_offset );
+	      buffer, fspec->file, INFO->partition_offset );
 
-     if ( file->of_device == PROM_INVALID_HANDLE || file->of_device == NULL )
+     if ( m->of_device == PROM_INVALID_HANDLE || m->of_device == NULL )
      {
-	  DEBUG_F( "Can't open device %p\n", file->of_device );
-	  DEBUG_LEAVE(FILE_ERR_BADDEV);
-	  return FILE_ERR_BADDEV;
+	  DEBUG_F( "Can't open device %p\n", m->of_device );
+	  free( m );
+	  *error = FILE_ERR_BADDEV;
+	  return NULL;
      }
 
-     DEBUG_F("%p was successfully opened\n", file->of_device);
+     DEBUG_F("%p was successfully opened\n", m->of_device);
 
      if ( reiserfs_read_super() != 1 )
      {
 	  DEBUG_F( "Couldn't open ReiserFS @ %s/%Lu\n", buffer, INFO->partition_offset );
-	  prom_close( file->of_device );
-	  DEBUG_LEAVE(FILE_ERR_BAD_FSYS);
-	  return FILE_ERR_BAD_FSYS;
+	  reiserfs_mount_free( m );
+	  *error = FILE_ERR_BAD_FSYS;
+	  return NULL;
+     }
+
+     m->cached = fs_mount_add( fspec->dev, part, &reiserfs_filesystem, m ) != NULL;
+     return m;
+}
+
+static int
+reiserfs_open( struct boot_file_t *file, struct partition_t *part,
+		struct boot_fspec_t *fspec)
+{
+     static char buffer[1024];
+     char *file_name = fspec->file;
+     struct reiserfs_mount *m;
+     int error = FILE_ERR_BAD_FSYS;
+
+     DEBUG_ENTER;
+     DEBUG_OPEN;
+
+     m = reiserfs_mount( file, part, fspec, &error );
+     if ( !m )
+     {
+	  DEBUG_LEAVE_F(error);
+	  return error;
      }
+     reiserfs_use( m );
+     INFO->file = file;
+     file->of_device = m->of_device;
+     file->priv = m;
 
      DEBUG_F( "Attempting to open %s\n", file_name );
      strcpy(buffer, file_name); /* reiserfs_open_file modifies argument */
      if (reiserfs_open_file(buffer) == 0)
      {
 	  DEBUG_F( "reiserfs_open_file failed. errnum = %d\n", errnum );
-	  prom_close( file->of_device );
+	  reiserfs_close( file );
 	  DEBUG_LEAVE_F(errnum);
 	  return errnum;
      }
@@ -132,6 +201,8 @@ reiserfs_open( struct boot_file_t *file, struct partition_t *part,
 static int
 reiserfs_read( struct boot_file_t *file, unsigned int size, void *buffer )
 {
+     reiserfs_use( file->priv );
+     INFO->file = file;
      return reiserfs_read_data( buffer, size );
 }
 
@@ -142,18 +213,42 @@ reiserfs_seek( struct boot_file_t *file, unsigned int newpos )
      return FILE_ERR_OK;
 }
 
+/* The filesystem stays mounted, reiserfs_umount() tears it down */
 static int
 reiserfs_close( struct boot_file_t *file )
 {
-     if( file->of_device )
+     struct reiserfs_mount *m = file->priv;
+
+     if( m )
      {
-	  prom_close(file->of_device);
+	  if ( !m->cached )
+	       reiserfs_mount_free( m );
+	  if ( INFO == &m->state )
+	       INFO = NULL;
+	  file->priv = NULL;
 	  file->of_device = 0;
 	  DEBUG_F("reiserfs_close called\n");
      }
      return FILE_ERR_OK;
 }
 
+/* Set from the stat item by reiserfs_open_file() */
+static unsigned int
+reiserfs_ino_size( struct boot_file_t *file )
+{
+     return file->len;
+}
+
+static void
+reiserfs_umount( struct fs_mount_t *mount )
+{
+     struct reiserfs_mount *m = mount->priv;
+
+     if ( INFO == &m->state )
+	  INFO = NULL;
+     reiserfs_mount_free( m );
+}
+
 
 static __inline__ __u32
 reiserfs_log2( __u32 word )
@@ -169,16 +264,32 @@ is_power_of_two( unsigned long word )
      return ( word & -word ) == word;
 }
 
-static int
-read_disk_block( struct boot_file_t *file, __u32 block, __u32 start,
-                 __u32 length, void *buf )
+static unsigned long long
+disk_offset( __u32 block, __u32 start )
 {
      __u16 fs_blocksize = INFO->blocksize == 0 ? REISERFS_OLD_BLOCKSIZE
 	  : INFO->blocksize;
      unsigned long long pos = (unsigned long long)block * (unsigned long long)fs_blocksize;
-     pos += (unsigned long long)INFO->partition_offset + (unsigned long long)start;
+     return pos + (unsigned long long)INFO->partition_offset + (unsigned long long)start;
+}
+
+/* Metadata reads go through the block cache */
+static int
+read_disk_block( struct boot_file_t *file, __u32 block, __u32 start,
+                 __u32 length, void *buf )
+{
+     unsigned long long pos = disk_offset( block, start );
      DEBUG_F( "Reading %u bytes, starting at block %u, disk offset %Lu\n",
 	      length, block, pos );
+     return bcache_read( file->of_device, pos, buf, length );
+}
+
+/* File data is read once, keep it out of the cache */
+static int
+read_data_block( struct boot_file_t *file, __u32 block, __u32 start,
+		 __u32 length, void *buf )
+{
+     unsigned long long pos = disk_offset( block, start );
      if (!prom_lseek( file->of_device, pos )) {
 	  DEBUG_F("prom_lseek failed\n");
 	  return 0;
@@ -186,6 +297,82 @@ read_disk_block( struct boot_file_t *file, __u32 block, __u32 start,
      return prom_read( file->of_device, buf, length );
 }
 
+/* Physically contiguous data blocks waiting to be read in one go */
+struct data_run {
+     __u32 block;		/* First block of the run */
+     __u32 start;		/* Byte offset into the first block */
+     __u32 len;			/* Bytes in the run */
+     char *buf;			/* Where the run goes */
+};
+
+static void
+flush_run( struct data_run *run )
+{
+     if ( run->len
+	  && read_data_block( INFO->file, run->block, run->start, run->len,
+			      run->buf ) != run->len )
+	  errnum = FILE_IOERR;
+     run->len = 0;
+}
+
+
+#define JOURNAL_MAP_MIN_SIZE	256
+
+/* Find the slot of realblock in the journal map, or the empty slot where
+ * it would go */
+static struct reiserfs_journal_map *
+journal_map_slot( struct reiserfs_journal_map *map, __u32 mask, __u32 realblock )
+{
+     __u32 i = ( realblock * 2654435761U ) & mask;
+
+     while ( map[i].realblock != 0 && map[i].realblock != realblock )
+	  i = ( i + 1 ) & mask;
+     return &map[i];
+}
+
+/* Record that the latest copy of realblock is at journalblock, growing
+ * the table so it stays at most 3/4 full */
+static int
+journal_map_add( __u32 realblock, __u32 journalblock )
+{
+     struct reiserfs_journal_map *slot;
+
+     if ( ( INFO->journal_map_count + 1 ) * 4 > ( INFO->journal_map_mask + 1 ) * 3 )
+     {
+	  __u32 size = INFO->journal_map ? ( INFO->journal_map_mask + 1 ) * 2
+	       : JOURNAL_MAP_MIN_SIZE;
+	  struct reiserfs_journal_map *map;
+	  __u32 i;
+
+	  map = malloc( size * sizeof(struct reiserfs_journal_map) );
+	  if ( !map )
+	  {
+	       prom_printf( "ReiserFS: no memory for %u journal blocks\n",
+			    INFO->journal_map_count );
+	       errnum = FILE_ERR_NOMEM;
+	       return 0;
+	  }
+	  memset( map, 0, size * sizeof(struct reiserfs_journal_map) );
+	  if ( INFO->journal_map )
+	  {
+	       for ( i = 0; i <= INFO->journal_map_mask; i++ )
+		    if ( INFO->journal_map[i].realblock )
+			 *journal_map_slot( map, size - 1,
+					    INFO->journal_map[i].realblock )
+			      = INFO->journal_map[i];
+	       free( INFO->journal_map );
+	  }
+	  INFO->journal_map = map;
+	  INFO->journal_map_mask = size - 1;
+     }
+
+     slot = journal_map_slot( INFO->journal_map, INFO->journal_map_mask, realblock );
+     if ( slot->realblock == 0 )
+	  INFO->journal_map_count++;
+     slot->realblock = realblock;
+     slot->journalblock = journalblock;
+     return 1;
+}
 
 static int
 journal_read( __u32 block, __u32 len, char *buffer )
@@ -202,85 +389,28 @@ journal_read( __u32 block, __u32 len, char *buffer )
 static int
 block_read( __u32 blockNr, __u32 start, __u32 len, char *buffer )
 {
-     __u32 transactions = INFO->journal_transactions;
-     __u32 desc_block = INFO->journal_first_desc;
-     __u32 journal_mask = INFO->journal_block_count - 1;
      __u32 translatedNr = blockNr;
-     __u32 *journal_table = JOURNAL_START;
-
-//    DEBUG_F( "block_read( %u, %u, %u, ..)\n", blockNr, start, len );
 
-     while ( transactions-- > 0 )
+     if ( INFO->journal_map && blockNr != 0 )
      {
-	  int i = 0;
-	  int j_len = 0;
+	  struct reiserfs_journal_map *slot =
+	       journal_map_slot( INFO->journal_map, INFO->journal_map_mask, blockNr );
 
-	  if ( *journal_table != 0xffffffff )
-	  {
-	       /* Search for the blockNr in cached journal */
-	       j_len = le32_to_cpu((*journal_table)++);
-	       while ( i++ < j_len )
-	       {
-		    if ( le32_to_cpu(*journal_table++) == blockNr )
-		    {
-			 journal_table += j_len - i;
-			 goto found;
-		    }
-	       }
-	  }
-	  else
+	  if ( slot->realblock == blockNr )
 	  {
-	       /* This is the end of cached journal marker.  The remaining
-		* transactions are still on disk. */
-	       struct reiserfs_journal_desc desc;
-	       struct reiserfs_journal_commit commit;
-
-	       if ( !journal_read( desc_block, sizeof(desc), (char *) &desc ) )
-		    return 0;
-
-	       j_len = le32_to_cpu(desc.j_len);
-	       while ( i < j_len && i < JOURNAL_TRANS_HALF )
-		    if ( le32_to_cpu(desc.j_realblock[i++]) == blockNr )
-			 goto found;
-
-	       if ( j_len >= JOURNAL_TRANS_HALF )
-	       {
-		    int commit_block = ( desc_block + 1 + j_len ) & journal_mask;
-
-		    if ( !journal_read( commit_block,
-					sizeof(commit), (char *) &commit ) )
-			 return 0;
-
-		    while ( i < j_len )
-			 if ( le32_to_cpu(commit.j_realblock[i++ - JOURNAL_TRANS_HALF]) == blockNr )
-			      goto found;
-	       }
+	       translatedNr = slot->journalblock;
+	       DEBUG_F( "block_read: block %u is mapped to journal block %u.\n",
+			blockNr, translatedNr - INFO->journal_block );
 	  }
-	  goto not_found;
-
-     found:
-	  translatedNr =
-	       INFO->journal_block + ( ( desc_block + i ) & journal_mask );
-
-	  DEBUG_F( "block_read: block %u is mapped to journal block %u.\n",
-		   blockNr, translatedNr - INFO->journal_block );
-
-	  /* We must continue the search, as this block may be overwritten in
-	   * later transactions. */
-     not_found:
-	  desc_block = (desc_block + 2 + j_len) & journal_mask;
      }
 
      return read_disk_block( INFO->file, translatedNr, start, len, buffer );
 }
 
-/* Init the journal data structure.  We try to cache as much as
- * possible in the JOURNAL_START-JOURNAL_END space, but if it is full
- * we can still read the rest from the disk on demand.
- *
- * The first number of valid transactions and the descriptor block of the
- * first valid transaction are held in INFO.  The transactions are all
- * adjacent, but we must take care of the journal wrap around.
+/* Init the journal map.  Every block of every valid unflushed
+ * transaction is entered in the hash, later transactions overriding
+ * earlier ones, so block_read() needs a single lookup.  The transactions
+ * are all adjacent, but we must take care of the journal wrap around.
  */
 static int
 journal_init( void )
@@ -292,15 +422,14 @@ journal_init( void )
      __u32 desc_block;
      __u32 commit_block;
      __u32 next_trans_id;
-     __u32 *journal_table = JOURNAL_START;
+     __u32 j_len;
+     __u32 i;
 
      journal_read( block_count, sizeof ( header ), ( char * ) &header );
      desc_block = le32_to_cpu(header.j_first_unflushed_offset);
      if ( desc_block >= block_count )
-	  return 0;
+	  return 1;
 
-     INFO->journal_transactions = 0;
-     INFO->journal_first_desc = desc_block;
      next_trans_id = le32_to_cpu(header.j_last_flush_trans_id) + 1;
 
      DEBUG_F( "journal_init: last flushed %u\n", le32_to_cpu(header.j_last_flush_trans_id) );
@@ -309,12 +438,13 @@ journal_init( void )
      {
 	  journal_read( desc_block, sizeof(desc), (char *) &desc );
 	  if ( strcmp( JOURNAL_DESC_MAGIC, desc.j_magic ) != 0
-	       || desc.j_trans_id != next_trans_id
+	       || le32_to_cpu(desc.j_trans_id) != next_trans_id
 	       || desc.j_mount_id != header.j_mount_id )
 	       /* no more valid transactions */
 	       break;
 
-	  commit_block = ( desc_block + le32_to_cpu(desc.j_len) + 1 ) & ( block_count - 1 );
+	  j_len = le32_to_cpu(desc.j_len);
+	  commit_block = ( desc_block + j_len + 1 ) & ( block_count - 1 );
 	  journal_read( commit_block, sizeof(commit), (char *) &commit );
 	  if ( desc.j_trans_id != commit.j_trans_id
 	       || desc.j_len != commit.j_len )
@@ -328,54 +458,24 @@ journal_init( void )
 
 
 	  next_trans_id++;
-	  if ( journal_table < JOURNAL_END )
+	  for ( i = 0; i < j_len; i++ )
 	  {
-	       if ( ( journal_table + 1 + le32_to_cpu(desc.j_len) ) >= JOURNAL_END )
-	       {
-		    /* The table is almost full; mark the end of the cached * *
-		     * journal. */
-		    *journal_table = 0xffffffff;
-		    journal_table = JOURNAL_END;
-	       }
-	       else
-	       {
-		    int i;
-
-		    /* Cache the length and the realblock numbers in the table. *
-		     * The block number of descriptor can easily be computed. *
-		     * and need not to be stored here. */
-		    *journal_table++ = desc.j_len;
-		    for ( i = 0; i < le32_to_cpu(desc.j_len) && i < JOURNAL_TRANS_HALF; i++ )
-		    {
-			 *journal_table++ = desc.j_realblock[i];
-
-			 DEBUG_F( "block %u is in journal %u.\n",
-				  le32_to_cpu(desc.j_realblock[i]), desc_block );
-
-		    }
-		    for ( ; i < le32_to_cpu(desc.j_len); i++ )
-		    {
-			 *journal_table++ =
-			      commit.j_realblock[i - JOURNAL_TRANS_HALF];
+	       __u32 realblock = ( i < JOURNAL_TRANS_HALF )
+		    ? le32_to_cpu(desc.j_realblock[i])
+		    : le32_to_cpu(commit.j_realblock[i - JOURNAL_TRANS_HALF]);
 
-			 DEBUG_F( "block %u is in journal %u.\n",
-				  le32_to_cpu(commit.j_realblock[i - JOURNAL_TRANS_HALF]),
-				  desc_block );
-
-		    }
-	       }
+	       if ( !journal_map_add( realblock, INFO->journal_block
+				      + ( ( desc_block + 1 + i ) & ( block_count - 1 ) ) ) )
+		    return 0;
 	  }
 	  desc_block = (commit_block + 1) & (block_count - 1);
      }
 
-     DEBUG_F( "Transaction %u/%u at %u isn't valid.\n",
+     DEBUG_F( "Transaction %u/%u at %u isn't valid, %u blocks journaled.\n",
 	      le32_to_cpu(desc.j_trans_id), le32_to_cpu(desc.j_mount_id),
-	      desc_block );
+	      desc_block, INFO->journal_map_count );
 
-
-     INFO->journal_transactions
-	  = next_trans_id - le32_to_cpu(header.j_last_flush_trans_id) - 1;
-     return (errnum == 0);
+     return 1;
 }
 
 /* check filesystem types and read superblock into memory buffer */
@@ -433,7 +533,9 @@ reiserfs_read_super( void )
      INFO->journal_block = le32_to_cpu(super.s_journal_block);
      INFO->journal_block_count = le32_to_cpu(super.s_orig_journal_size);
 
-     INFO->cached_slots = (FSYSREISER_CACHE_SIZE >> INFO->blocksize_shift) - 1;
+     INFO->cached_slots = FSYSREISER_CACHE_SIZE >> INFO->blocksize_shift;
+     if ( INFO->cached_slots > FSYSREISER_CACHE_NODES )
+	  INFO->cached_slots = FSYSREISER_CACHE_NODES;
 
      /* At this point, we've found a valid superblock. If we run into problems
       * mounting the FS, the user should probably know. */
@@ -465,7 +567,8 @@ reiserfs_read_super( void )
 	       return 0;
 	  }
 
-	  journal_init();
+	  if ( !journal_init() )
+	       return 0;
 	  /* Read in super block again, maybe it is in the journal */
 	  block_read( superblock, 0, sizeof (struct reiserfs_super_block),
 		      (char *) &super );
@@ -498,7 +601,7 @@ reiserfs_read_super( void )
      {
 	  /* There is only one node in the whole filesystem, which is
 	     simultanously leaf and root */
-	  memcpy( LEAF, ROOT, INFO->blocksize );
+	  LEAF = ROOT;
      }
      return 1;
 }
@@ -509,11 +612,13 @@ reiserfs_read_super( void )
  * http://devlinux.com/projects/reiserfs/
  *
  * My tree node cache is organized as following
- *   0   ROOT node
- *   1   LEAF node  (if the ROOT is also a LEAF it is copied here
- *   2-n other nodes on current path from bottom to top.
- *       if there is not enough space in the cache, the top most are
- *       omitted.
+ *   0   ROOT node, always resident
+ *   1-n other nodes of any path, keyed by block number and replaced
+ *       least recently used first.  LEAF points to the slot of the
+ *       current leaf (or to ROOT if the root is also a leaf).
+ *
+ * INFO->blocks[] remembers the block numbers of the current path so
+ * next_key() can climb back up it.
  *
  * I have only two methods to find a key in the tree:
  *   search_stat(dir_id, objectid) searches for the stat entry (always
@@ -524,27 +629,30 @@ reiserfs_read_super( void )
  * efficient, but this really doesn't hurt for grub.
  */
 
-/* Read in the node at the current path and depth into the node cache.
- * You must set INFO->blocks[depth] before.
+/* Find the node blockNr in the node cache or read it in, and make it the
+ * node of the current path at depth.
  */
 static char *
 read_tree_node( __u32 blockNr, __u16 depth )
 {
-     char *cache = CACHE(depth);
-     int num_cached = INFO->cached_slots;
+     char *cache;
+     int slot, victim = 1;
      errnum = 0;
 
-     if ( depth < num_cached )
+     for ( slot = 1; slot < INFO->cached_slots; slot++ )
      {
-	  /* This is the cached part of the path.
-	     Check if same block is needed. */
-	  if ( blockNr == INFO->blocks[depth] )
-	       return cache;
+	  if ( blockNr && INFO->node_block[slot] == blockNr )
+	       goto found;
+	  if ( INFO->node_used[slot] < INFO->node_used[victim] )
+	       victim = slot;
      }
-     else
-	  cache = CACHE(num_cached);
 
-     DEBUG_F( "  next read_in: block=%u (depth=%u)\n", blockNr, depth );
+     slot = victim;
+     cache = CACHE(slot);
+     INFO->node_block[slot] = 0;
+     INFO->node_used[slot] = 0;
+
+     DEBUG_F( "  next read_in: block=%u (depth=%u) slot=%d\n", blockNr, depth, slot );
 
      if ( !block_read( blockNr, 0, INFO->blocksize, cache ) )
      {
@@ -565,8 +673,14 @@ read_tree_node( __u32 blockNr, __u16 depth )
 	  errnum = FILE_ERR_BAD_FSYS;
 	  return 0;
      }
+     INFO->node_block[slot] = blockNr;
 
+found:
+     cache = CACHE(slot);
+     INFO->node_used[slot] = ++INFO->node_clock;
      INFO->blocks[depth] = blockNr;
+     if ( depth == BLKH_LEVEL_LEAF )
+	  LEAF = cache;
      return cache;
 }
 
@@ -614,14 +728,9 @@ next_key( void )
 
 	  if ( depth == INFO->tree_depth )
 	       cache = ROOT;
-	  else if ( depth <= INFO->cached_slots )
-	       cache = CACHE( depth );
 	  else
 	  {
-	       /* Save depth as using it twice as args to read_tree_node()
-	        * has undefined behaviour */
-	       __u16 d = depth;
-	       cache = read_tree_node( INFO->blocks[d], --depth );
+	       cache = read_tree_node( INFO->blocks[depth], depth );
 	       if ( !cache )
 		    return 0;
 	  }
@@ -755,7 +864,9 @@ reiserfs_read_data( char *buf, __u32 len )
      __u32 offset;
      __u32 to_read;
      char *prev_buf = buf;
+     struct data_run run;
      errnum = 0;
+     run.len = 0;
 
      DEBUG_F( "reiserfs_read_data: INFO->file->pos=%Lu len=%u, offset=%Lu\n",
 	      INFO->file->pos, len, (__u64) IH_KEY_OFFSET(INFO->current_ih) - 1 );
@@ -807,9 +918,24 @@ reiserfs_read_data( char *buf, __u32 len )
 			 to_read = len;
 
 		    /* Journal is only for meta data.
-		       Data blocks can be read directly without using block_read */
-		    read_disk_block( INFO->file, blocknr, blk_offset, to_read,
-				     buf );
+		       Data blocks can be read directly without using block_read.
+		       Blocks following the pending run on disk extend it, even
+		       across items, so a whole extent goes out as one read. */
+		    if ( blocknr == 0 )
+			 memset( buf, 0, to_read );
+		    else if ( run.len && blk_offset == 0
+			      && run.buf + run.len == buf
+			      && ( ( run.start + run.len ) & ( INFO->blocksize - 1 ) ) == 0
+			      && blocknr == run.block + ( ( run.start + run.len ) >> INFO->blocksize_shift ) )
+			 run.len += to_read;
+		    else
+		    {
+			 flush_run( &run );
+			 run.block = blocknr;
+			 run.start = blk_offset;
+			 run.len = to_read;
+			 run.buf = buf;
+		    }
 
 	       update_buf_len:
 		    len -= to_read;
@@ -824,6 +950,7 @@ reiserfs_read_data( char *buf, __u32 len )
 	  next_key();
      }
 done:
+     flush_run( &run );
      return (errnum != 0) ? 0 : buf - prev_buf;
 }
 
@@ -30,6 +30,7 @@
 #include "xfs/xfs.h"
 #include "errors.h"
 #include "debug.h"
+#include "bcache.h"
 #include "bootinfo.h"
 
 #define SECTOR_BITS 9
@@ -44,73 +45,167 @@ static int xfs_open(struct boot_file_t *file,
 static int xfs_read(struct boot_file_t *file, unsigned int size, void *buffer);
 static int xfs_seek(struct boot_file_t *file, unsigned int newpos);
 static int xfs_close(struct boot_file_t *file);
+static unsigned int xfs_ino_size(struct boot_file_t *file);
+static void xfs_umount(struct fs_mount_t *mount);
 
 struct fs_t xfs_filesystem = {
 	name:"xfs",
 	open:xfs_open,
 	read:xfs_read,
 	seek:xfs_seek,
-	close:xfs_close
+	close:xfs_close,
+	ino_size:xfs_ino_size,
+	umount:xfs_umount
+};
+
+#define MAX_LINK_COUNT	8
+
+typedef struct xad {
+	xfs_fileoff_t offset;
+	xfs_fsblock_t start;
+	xfs_filblks_t len;
+} xad_t;
+
+struct xfs_info {
+	int bsize;
+	int dirbsize;
+	int isize;
+	unsigned int agblocks;
+	int bdlog;
+	int blklog;
+	int inopblog;
+	int agblklog;
+	int agnolog;
+	int dirblklog;
+	xfs_dablk_t forw;
+	xfs_dablk_t dablk;
+	xad_t *xad;		/* decoded extents of the current inode */
+	unsigned int nxad;
+	unsigned int xad_alloc;
+	unsigned int xad_cur;	/* extent the last lookup landed in */
+	char *leaf;		/* bmap btree block buffer */
+	xfs_bmbt_ptr_t ptr0;
+	int btnode_ptr0_off;
+	int i8param;
+	int dirpos;
+	int dirmax;
+	int blkoff;
+	xfs_ino_t rootino;
+};
+
+/* Mounted filesystem state, one per partition in the mount table */
+struct xfs_mount_info {
+	struct xfs_info info;
+	uint64_t partition_offset;
+	ihandle of_device;
+	int cached;
 };
 
 struct boot_file_t *xfs_file;
+static struct xfs_mount_info *xfs_mnt;
 static char FSYS_BUF[32768];
-uint64_t partition_offset;
 int errnum;
 
-static int
-xfs_open(struct boot_file_t *file,
-	 struct partition_t *part, struct boot_fspec_t *fspec)
+#define xfs		(xfs_mnt->info)
+
+static void
+xfs_mount_free(struct xfs_mount_info *m)
+{
+	if (m->info.xad)
+		free(m->info.xad);
+	if (m->info.leaf)
+		free(m->info.leaf);
+	bcache_invalidate(m->of_device);
+	prom_close(m->of_device);
+	free(m);
+}
+
+/* Find the mount of this partition, or mount it */
+static struct xfs_mount_info *
+xfs_mount_part(struct partition_t *part, struct boot_fspec_t *fspec, int *error)
 {
 	static char buffer[1024];
+	struct fs_mount_t *mount;
+	struct xfs_mount_info *m;
 
-	DEBUG_ENTER;
-	DEBUG_OPEN;
+	mount = fs_mount_lookup(fspec->dev, part ? part->part_number : -1);
+	if (mount && mount->fs == &xfs_filesystem)
+		return mount->priv;
+
+	m = malloc(sizeof(struct xfs_mount_info));
+	if (!m) {
+		*error = FILE_ERR_NOMEM;
+		return NULL;
+	}
+	memset(m, 0, sizeof(struct xfs_mount_info));
 
 	if (part)
 	{
 		DEBUG_F("Determining offset for partition %d\n", part->part_number);
-		partition_offset = ((uint64_t) part->part_start) * part->blocksize;
-		DEBUG_F("%Lu = %lu * %hu\n", partition_offset,
+		m->partition_offset = ((uint64_t) part->part_start) * part->blocksize;
+		DEBUG_F("%Lu = %lu * %hu\n", m->partition_offset,
 			part->part_start,
 			part->blocksize);
 	}
-	else
-		partition_offset = 0;
 
 	strncpy(buffer, fspec->dev, 1020);
 	if (_machine != _MACH_bplan)
 		strcat(buffer, ":0");  /* 0 is full disk in (non-buggy) OF */
 	DEBUG_F("Trying to open dev_name=%s; filename=%s; partition offset=%Lu\n",
-		buffer, fspec->file, partition_offset);
-	file->of_device = prom_open(buffer);
+		buffer, fspec->file, m->partition_offset);
+	m->of_device = prom_open(buffer);
 
-	if (file->of_device == PROM_INVALID_HANDLE || file->of_device == NULL)
+	if (m->of_device == PROM_INVALID_HANDLE || m->of_device == NULL)
 	{
-		DEBUG_F("Can't open device %p\n", file->of_device);
-		DEBUG_LEAVE(FILE_ERR_BADDEV);
-		return FILE_ERR_BADDEV;
+		DEBUG_F("Can't open device %p\n", m->of_device);
+		free(m);
+		*error = FILE_ERR_BADDEV;
+		return NULL;
 	}
 
-	DEBUG_F("%p was successfully opened\n", file->of_device);
-
-	xfs_file = file;
+	DEBUG_F("%p was successfully opened\n", m->of_device);
 
+	xfs_mnt = m;
 	if (xfs_mount() != 1)
 	{
-		DEBUG_F("Couldn't open XFS @ %s/%Lu\n", buffer, partition_offset);
-		prom_close(file->of_device);
-		DEBUG_LEAVE(FILE_ERR_BAD_FSYS);
+		DEBUG_F("Couldn't open XFS @ %s/%Lu\n", buffer, m->partition_offset);
+		xfs_mount_free(m);
+		xfs_mnt = NULL;
+		*error = FILE_ERR_BAD_FSYS;
+		return NULL;
+	}
+
+	m->cached = fs_mount_add(fspec->dev, part, &xfs_filesystem, m) != NULL;
+	return m;
+}
+
+static int
+xfs_open(struct boot_file_t *file,
+	 struct partition_t *part, struct boot_fspec_t *fspec)
+{
+	static char buffer[1024];
+	int error = FILE_ERR_BAD_FSYS;
+
+	DEBUG_ENTER;
+	DEBUG_OPEN;
+
+	xfs_file = file;
+	xfs_mnt = xfs_mount_part(part, fspec, &error);
+	if (!xfs_mnt)
+	{
+		DEBUG_LEAVE_F(error);
 		DEBUG_SLEEP;
-		return FILE_ERR_BAD_FSYS;
+		return error;
 	}
+	file->of_device = xfs_mnt->of_device;
+	file->priv = xfs_mnt;
 
 	DEBUG_F("Attempting to open %s\n", fspec->file);
 	strcpy(buffer, fspec->file); /* xfs_dir modifies argument */
 	if(!xfs_dir(buffer))
 	{
 		DEBUG_F("xfs_dir() failed. errnum = %d\n", errnum);
-		prom_close( file->of_device );
+		xfs_close(file);
 		DEBUG_LEAVE_F(errnum);
 		DEBUG_SLEEP;
 		return errnum;
@@ -125,6 +220,8 @@ xfs_open(struct boot_file_t *file,
 static int
 xfs_read(struct boot_file_t *file, unsigned int size, void *buffer)
 {
+	xfs_file = file;
+	xfs_mnt = file->priv;
 	return xfs_read_data(buffer, size);
 }
 
@@ -135,70 +232,50 @@ xfs_seek(struct boot_file_t *file, unsigned int newpos)
 	return FILE_ERR_OK;
 }
 
+/* The filesystem stays mounted, xfs_umount() tears it down */
 static int
 xfs_close(struct boot_file_t *file)
 {
-	if(file->of_device)
+	struct xfs_mount_info *m = file->priv;
+
+	if (m)
 	{
-		prom_close(file->of_device);
+		if (!m->cached)
+			xfs_mount_free(m);
+		if (xfs_mnt == m)
+			xfs_mnt = NULL;
+		file->priv = NULL;
 		file->of_device = 0;
 		DEBUG_F("xfs_close called\n");
 	}
 	return FILE_ERR_OK;
 }
 
+static unsigned int
+xfs_ino_size(struct boot_file_t *file)
+{
+	return file->len;
+}
+
+static void
+xfs_umount(struct fs_mount_t *mount)
+{
+	if (xfs_mnt == mount->priv)
+		xfs_mnt = NULL;
+	xfs_mount_free(mount->priv);
+}
+
 static int
 read_disk_block(struct boot_file_t *file, uint64_t block, int start,
 		int length, void *buf)
 {
 	uint64_t pos = block * 512;
-	pos += partition_offset + start;
+	pos += xfs_mnt->partition_offset + start;
 	DEBUG_F("Reading %d bytes, starting at block %Lu, disk offset %Lu\n",
 		length, block, pos);
-	if (!prom_lseek(file->of_device, pos)) {
-		DEBUG_F("prom_lseek failed\n");
-		return 0;
-	}
-	return prom_read(file->of_device, buf, length);
+	return bcache_read(file->of_device, pos, buf, length);
 }
 
-#define MAX_LINK_COUNT	8
-
-typedef struct xad {
-	xfs_fileoff_t offset;
-	xfs_fsblock_t start;
-	xfs_filblks_t len;
-} xad_t;
-
-struct xfs_info {
-	int bsize;
-	int dirbsize;
-	int isize;
-	unsigned int agblocks;
-	int bdlog;
-	int blklog;
-	int inopblog;
-	int agblklog;
-	int agnolog;
-	int dirblklog;
-	unsigned int nextents;
-	xfs_daddr_t next;
-	xfs_daddr_t daddr;
-	xfs_dablk_t forw;
-	xfs_dablk_t dablk;
-	xfs_bmbt_rec_32_t *xt;
-	xfs_bmbt_ptr_t ptr0;
-	int btnode_ptr0_off;
-	int i8param;
-	int dirpos;
-	int dirmax;
-	int blkoff;
-	int fpos;
-	xfs_ino_t rootino;
-};
-
-static struct xfs_info xfs;
-
 #define dirbuf		((char *)FSYS_BUF)
 #define filebuf		((char *)FSYS_BUF + 4096)
 #define inode		((xfs_dinode_t *)((char *)FSYS_BUF + 8192))
@@ -347,6 +424,137 @@ btroot_maxrecs (void)
 		(sizeof (xfs_bmbt_key_t) + sizeof (xfs_bmbt_ptr_t));
 }
 
+#ifndef NULLDFSBNO
+#define NULLDFSBNO	((xfs_dfsbno_t)-1)
+#endif
+
+static void
+xad_decode (xad_t *xad, xfs_bmbt_rec_32_t *r)
+{
+	xad->offset = xt_offset (r);
+	xad->start = xt_start (r);
+	xad->len = xt_len (r);
+}
+
+/*
+ * Decode the extent list of the current inode into xfs.xad.  B-tree
+ * mapped files have their leaves read whole, walking the right sibling
+ * chain from the leftmost leaf.
+ */
+static int
+map_extents (void)
+{
+	xfs_btree_lblock_t *h;
+	xfs_bmbt_ptr_t ptr0;
+	xfs_dfsbno_t fsbno;
+	unsigned int nextents, i, n;
+
+	xfs.nxad = 0;
+	xfs.xad_cur = 0;
+	if (icore.di_format != XFS_DINODE_FMT_EXTENTS
+	    && icore.di_format != XFS_DINODE_FMT_BTREE)
+		return 1;
+
+	nextents = le32 (icore.di_nextents);
+	if (nextents > xfs.xad_alloc) {
+		xad_t *xad = realloc(xfs.xad, nextents * sizeof(xad_t));
+		if (!xad) {
+			errnum = FILE_ERR_NOMEM;
+			return 0;
+		}
+		xfs.xad = xad;
+		xfs.xad_alloc = nextents;
+	}
+
+	if (icore.di_format == XFS_DINODE_FMT_EXTENTS) {
+		for (i = 0; i < nextents; i++)
+			xad_decode (&xfs.xad[i], &inode->di_u.di_bmx[i]);
+		xfs.nxad = nextents;
+		return 1;
+	}
+
+	if (!xfs.leaf) {
+		xfs.leaf = malloc(xfs.bsize);
+		if (!xfs.leaf) {
+			errnum = FILE_ERR_NOMEM;
+			return 0;
+		}
+	}
+	h = (xfs_btree_lblock_t *)xfs.leaf;
+
+	/* Descend the leftmost path to the first leaf */
+	ptr0 = xfs.ptr0;
+	for (;;) {
+		if (read_disk_block(xfs_file, fsb2daddr (le64(ptr0)), 0,
+				    xfs.bsize, xfs.leaf) != xfs.bsize) {
+			errnum = FILE_IOERR;
+			return 0;
+		}
+		if (!h->bb_level)
+			break;
+		ptr0 = *(xfs_bmbt_ptr_t *)(xfs.leaf + xfs.btnode_ptr0_off);
+	}
+
+	for (;;) {
+		xfs_bmbt_rec_32_t *r = (xfs_bmbt_rec_32_t *)
+			(xfs.leaf + sizeof(xfs_btree_block_t));
+
+		n = le16 (h->bb_numrecs);
+		if (n > nextents - xfs.nxad
+		    || sizeof(xfs_btree_block_t) + n * sizeof(*r) > xfs.bsize) {
+			DEBUG_F("bad bmap leaf, %u records\n", n);
+			errnum = FILE_ERR_BAD_FSYS;
+			return 0;
+		}
+		for (i = 0; i < n; i++)
+			xad_decode (&xfs.xad[xfs.nxad++], r++);
+
+		fsbno = le64 (h->bb_rightsib);
+		if (fsbno == NULLDFSBNO || xfs.nxad == nextents)
+			break;
+		if (read_disk_block(xfs_file, fsb2daddr (fsbno), 0,
+				    xfs.bsize, xfs.leaf) != xfs.bsize) {
+			errnum = FILE_IOERR;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Return the extent holding file block blk, or the first one after it
+ * when blk is in a hole.  Sequential reads stay on the cursor, seeks fall
+ * back to a binary search.
+ */
+static xad_t *
+find_extent (xfs_fileoff_t blk)
+{
+	xad_t *xad = xfs.xad;
+	int lo, hi, mid;
+
+	lo = xfs.xad_cur;
+	if (lo < xfs.nxad && blk >= xad[lo].offset) {
+		if (blk < xad[lo].offset + xad[lo].len)
+			return &xad[lo];
+		if (lo + 1 == xfs.nxad || blk < xad[lo + 1].offset + xad[lo + 1].len) {
+			xfs.xad_cur = ++lo;
+			return (lo < xfs.nxad) ? &xad[lo] : NULL;
+		}
+	}
+
+	lo = 0;
+	hi = xfs.nxad;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (xad[mid].offset + xad[mid].len <= blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	xfs.xad_cur = lo;
+	return (lo < xfs.nxad) ? &xad[lo] : NULL;
+}
+
 static int
 di_read (xfs_ino_t ino)
 {
@@ -368,76 +576,7 @@ di_read (xfs_ino_t ino)
 		    (inode->di_u.di_c + sizeof(xfs_bmdr_block_t)
 		    + btroot_maxrecs ()*sizeof(xfs_bmbt_key_t));
 
-	return 1;
-}
-
-static void
-init_extents (void)
-{
-	xfs_bmbt_ptr_t ptr0;
-	xfs_btree_lblock_t h;
-
-	switch (icore.di_format) {
-	case XFS_DINODE_FMT_EXTENTS:
-		xfs.xt = inode->di_u.di_bmx;
-		xfs.nextents = le32 (icore.di_nextents);
-		break;
-	case XFS_DINODE_FMT_BTREE:
-		ptr0 = xfs.ptr0;
-		for (;;) {
-			xfs.daddr = fsb2daddr (le64(ptr0));
-			read_disk_block(xfs_file, xfs.daddr, 0,
-					sizeof(xfs_btree_lblock_t), (char *)&h);
-			if (!h.bb_level) {
-				xfs.nextents = le16(h.bb_numrecs);
-				xfs.next = fsb2daddr (le64(h.bb_leftsib));
-				xfs.fpos = sizeof(xfs_btree_block_t);
-				return;
-			}
-			read_disk_block(xfs_file, xfs.daddr, xfs.btnode_ptr0_off,
-				 sizeof(xfs_bmbt_ptr_t), (char *)&ptr0);
-		}
-	}
-}
-
-static xad_t *
-next_extent (void)
-{
-	static xad_t xad;
-
-	switch (icore.di_format) {
-	case XFS_DINODE_FMT_EXTENTS:
-		if (xfs.nextents == 0)
-			return NULL;
-		break;
-	case XFS_DINODE_FMT_BTREE:
-		if (xfs.nextents == 0) {
-			xfs_btree_lblock_t h;
-			if (xfs.next == 0)
-				return NULL;
-			xfs.daddr = xfs.next;
-			read_disk_block(xfs_file, xfs.daddr, 0,
-					sizeof(xfs_btree_lblock_t), (char *)&h);
-			xfs.nextents = le16(h.bb_numrecs);
-			xfs.next = fsb2daddr (le64(h.bb_leftsib));
-			xfs.fpos = sizeof(xfs_btree_block_t);
-		}
-		/* Yeah, I know that's slow, but I really don't care */
-		read_disk_block(xfs_file, xfs.daddr, xfs.fpos,
-				sizeof(xfs_bmbt_rec_t), filebuf);
-		xfs.xt = (xfs_bmbt_rec_32_t *)filebuf;
-		xfs.fpos += sizeof(xfs_bmbt_rec_32_t);
-		break;
-	default:
-		return NULL;
-	}
-	xad.offset = xt_offset (xfs.xt);
-	xad.start = xt_start (xfs.xt);
-	xad.len = xt_len (xfs.xt);
-	++xfs.xt;
-	--xfs.nextents;
-
-	return &xad;
+	return map_extents ();
 }
 
 /*
@@ -447,17 +586,11 @@ static void
 xfs_dabread (void)
 {
 	xad_t *xad;
-	xfs_fileoff_t offset;;
-
-	init_extents ();
-	while ((xad = next_extent ())) {
-		offset = xad->offset;
-		if (isinxt (xfs.dablk, offset, xad->len)) {
-			read_disk_block(xfs_file, fsb2daddr (xad->start + xfs.dablk - offset),
-					0, 100, dirbuf);
-			break;
-		}
-	}
+
+	xad = find_extent (xfs.dablk);
+	if (xad && isinxt (xfs.dablk, xad->offset, xad->len))
+		read_disk_block(xfs_file, fsb2daddr (xad->start + xfs.dablk - xad->offset),
+				0, 100, dirbuf);
 }
 
 static inline xfs_ino_t
@@ -649,8 +782,7 @@ int
 xfs_read_data (char *buf, int len)
 {
 	xad_t *xad;
-	xfs_fileoff_t endofprev, endofcur, offset;
-	xfs_filblks_t xadlen;
+	xfs_fileoff_t endofcur, offset;
 	int toread, startpos, endpos;
 
 	if (icore.di_format == XFS_DINODE_FMT_LOCAL) {
@@ -663,31 +795,28 @@ xfs_read_data (char *buf, int len)
 	endpos = xfs_file->pos + len;
 	if (endpos > xfs_file->len)
 		endpos = xfs_file->len;
-	endofprev = (xfs_fileoff_t)-1;
-	init_extents ();
-	while (len > 0 && (xad = next_extent ())) {
-		offset = xad->offset;
-		xadlen = xad->len;
-		if (isinxt (xfs_file->pos >> xfs.blklog, offset, xadlen)) {
-			endofcur = (offset + xadlen) << xfs.blklog;
-			toread = (endofcur >= endpos)
-				  ? len : (endofcur - xfs_file->pos);
-			read_disk_block(xfs_file, fsb2daddr (xad->start),
-					xfs_file->pos - (offset << xfs.blklog), toread, buf);
+	while (xfs_file->pos < endpos) {
+		offset = xfs_file->pos >> xfs.blklog;
+		xad = find_extent (offset);
+		if (xad && isinxt (offset, xad->offset, xad->len)) {
+			endofcur = (xad->offset + xad->len) << xfs.blklog;
+			toread = ((endofcur >= endpos) ? endpos : endofcur)
+				 - xfs_file->pos;
+			if (read_disk_block(xfs_file, fsb2daddr (xad->start),
+					    xfs_file->pos - (xad->offset << xfs.blklog),
+					    toread, buf) != toread)
+				break;
 			buf += toread;
-			len -= toread;
 			xfs_file->pos += toread;
-		} else if (offset > endofprev) {
-			toread = ((offset << xfs.blklog) >= endpos)
-				  ? len : ((offset - endofprev) << xfs.blklog);
-			len -= toread;
+		} else {
+			/* Hole up to the next extent */
+			endofcur = xad ? xad->offset << xfs.blklog : endpos;
+			toread = ((endofcur >= endpos) ? endpos : endofcur)
+				 - xfs_file->pos;
 			xfs_file->pos += toread;
-			for (; toread; toread--) {
-				*buf++ = 0;
-			}
-			continue;
+			memset(buf, 0, toread);
+			buf += toread;
 		}
-		endofprev = offset + xadlen;
 	}
 
 	return xfs_file->pos - startpos;
@@ -708,7 +837,10 @@ xfs_dir (char *dirname)
 	parent_ino = ino = xfs.rootino;
 	link_count = 0;
 	for (;;) {
-		di_read (ino);
+		if (!di_read (ino)) {
+			DEBUG_LEAVE_F(errnum);
+			return 0;
+		}
 		di_size = le64 (icore.di_size);
 		di_mode = le16 (icore.di_mode);
 
@@ -0,0 +1,613 @@
+/*
+ *  gunzip.c - Inflate gzip compressed files while they are read
+ *
+ *  A compressed kernel is inflated as the ELF loader reads it, straight
+ *  into wherever the reads are aimed, so there is never a copy of the
+ *  whole compressed or uncompressed image.  The underlying file is read
+ *  a buffer at a time and the decoder keeps only the 32k window the
+ *  deflate format refers back into, so it needs about 50k of the malloc
+ *  pool whatever the size of the image.  Seeking forward inflates and
+ *  throws away, seeking back starts over from the beginning.  The loader
+ *  stops reading after the last segment, so gunzip_check() inflates the
+ *  rest to get to the CRC at the end.
+ *
+ *  The decoder follows the deflate (RFC 1951) and gzip (RFC 1952)
+ *  specifications the way Mark Adler's puff does, decoding Huffman codes
+ *  a bit at a time.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "stdlib.h"
+#include "string.h"
+#include "file.h"
+#include "fs.h"
+#include "gunzip.h"
+#include "errors.h"
+#include "debug.h"
+
+#define GZ_INBUF	0x4000		/* compressed data read at a time */
+#define GZ_WSIZE	0x8000		/* deflate window */
+#define GZ_WMASK	(GZ_WSIZE - 1)
+
+#define MAXBITS		15		/* longest Huffman code */
+#define MAXLCODES	286		/* literal/length codes */
+#define MAXDCODES	30		/* distance codes */
+#define FIXLCODES	288		/* literal/length codes in the fixed block */
+
+/* gzip header flags */
+#define GZ_FHCRC	0x02
+#define GZ_FEXTRA	0x04
+#define GZ_FNAME	0x08
+#define GZ_FCOMMENT	0x10
+#define GZ_FRESERVED	0xe0
+
+enum gz_state {
+     GZ_BLOCK,		/* at the start of a block */
+     GZ_STORED,		/* copying an uncompressed block */
+     GZ_CODES,		/* decoding a compressed block */
+     GZ_END		/* trailer checked, nothing more to come */
+};
+
+struct huffman {
+     short		count[MAXBITS + 1];	/* codes of each length */
+     short		symbol[FIXLCODES];	/* symbols by code */
+};
+
+struct gunzip {
+     struct boot_file_t	raw;		/* the compressed file */
+     unsigned char	in[GZ_INBUF];
+     unsigned int	in_pos, in_len;
+     unsigned long	bitbuf;
+     int		bitcnt;
+     int		error;
+
+     enum gz_state	state;
+     int		last;		/* in the final block */
+     unsigned int	stored_left;
+     unsigned int	copy_len;	/* of a match cut short by the caller */
+     unsigned int	copy_dist;
+
+     unsigned char	window[GZ_WSIZE];
+     unsigned long	total;		/* bytes inflated, the file position */
+     unsigned long	crc;
+
+     struct huffman	lencode, distcode;
+};
+
+static unsigned long crc_table[256];
+
+static int gunzip_read(struct boot_file_t* file, unsigned int size, void* buffer);
+static int gunzip_seek(struct boot_file_t* file, unsigned int newpos);
+static int gunzip_close(struct boot_file_t* file);
+
+const struct fs_t gunzip_filesystem =
+{
+     "gunzip",
+     NULL,
+     gunzip_read,
+     gunzip_seek,
+     gunzip_close,
+     NULL,
+     NULL,
+     NULL
+};
+
+static const short length_base[29] = {
+     3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+     35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short length_extra[29] = {
+     0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+     3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const short dist_base[30] = {
+     1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+     257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+     8193, 12289, 16385, 24577 };
+static const short dist_extra[30] = {
+     0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+     7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static void
+crc_init(void)
+{
+     unsigned long c;
+     int n, k;
+
+     if (crc_table[1])
+	  return;
+     for (n = 0; n < 256; n++) {
+	  c = n;
+	  for (k = 0; k < 8; k++)
+	       c = (c & 1) ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+	  crc_table[n] = c;
+     }
+}
+
+/* Next compressed byte, -1 at the end of the file */
+static int
+gz_byte(struct gunzip *gz)
+{
+     int len;
+
+     if (gz->in_pos == gz->in_len) {
+	  len = gz->raw.fs->read(&gz->raw, GZ_INBUF, gz->in);
+	  if (len <= 0) {
+	       gz->error = 1;
+	       return -1;
+	  }
+	  gz->in_pos = 0;
+	  gz->in_len = len;
+     }
+     return gz->in[gz->in_pos++];
+}
+
+static int
+gz_bits(struct gunzip *gz, int need)
+{
+     unsigned long val = gz->bitbuf;
+     int c;
+
+     while (gz->bitcnt < need) {
+	  c = gz_byte(gz);
+	  if (c < 0)
+	       return 0;
+	  val |= (unsigned long)c << gz->bitcnt;
+	  gz->bitcnt += 8;
+     }
+     gz->bitbuf = val >> need;
+     gz->bitcnt -= need;
+     return val & ((1UL << need) - 1);
+}
+
+/* Decode a symbol, -1 for a code that isn't in the table */
+static int
+gz_decode(struct gunzip *gz, const struct huffman *h)
+{
+     int len, code = 0, first = 0, count, index = 0;
+
+     for (len = 1; len <= MAXBITS; len++) {
+	  code |= gz_bits(gz, 1);
+	  count = h->count[len];
+	  if (code - count < first)
+	       return h->symbol[index + (code - first)];
+	  index += count;
+	  first += count;
+	  first <<= 1;
+	  code <<= 1;
+     }
+     return -1;
+}
+
+/* Build a decoding table from code lengths.  Returns 0 for a complete
+ * code, > 0 for an incomplete one and < 0 for an oversubscribed one.
+ */
+static int
+gz_construct(struct huffman *h, const short *length, int n)
+{
+     short offs[MAXBITS + 1];
+     int symbol, len, left;
+
+     for (len = 0; len <= MAXBITS; len++)
+	  h->count[len] = 0;
+     for (symbol = 0; symbol < n; symbol++)
+	  h->count[length[symbol]]++;
+     if (h->count[0] == n)
+	  return 0;
+
+     left = 1;
+     for (len = 1; len <= MAXBITS; len++) {
+	  left <<= 1;
+	  left -= h->count[len];
+	  if (left < 0)
+	       return left;
+     }
+
+     offs[1] = 0;
+     for (len = 1; len < MAXBITS; len++)
+	  offs[len + 1] = offs[len] + h->count[len];
+     for (symbol = 0; symbol < n; symbol++)
+	  if (length[symbol] != 0)
+	       h->symbol[offs[length[symbol]]++] = symbol;
+     return left;
+}
+
+static int
+gz_fixed(struct gunzip *gz)
+{
+     short lengths[FIXLCODES];
+     int symbol;
+
+     for (symbol = 0; symbol < 144; symbol++)
+	  lengths[symbol] = 8;
+     for (; symbol < 256; symbol++)
+	  lengths[symbol] = 9;
+     for (; symbol < 280; symbol++)
+	  lengths[symbol] = 7;
+     for (; symbol < FIXLCODES; symbol++)
+	  lengths[symbol] = 8;
+     gz_construct(&gz->lencode, lengths, FIXLCODES);
+
+     for (symbol = 0; symbol < MAXDCODES; symbol++)
+	  lengths[symbol] = 5;
+     gz_construct(&gz->distcode, lengths, MAXDCODES);
+     return 0;
+}
+
+static int
+gz_dynamic(struct gunzip *gz)
+{
+     static const short order[19] = {
+	  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+     short lengths[MAXLCODES + MAXDCODES];
+     int nlen, ndist, ncode, index, symbol, len, err;
+
+     nlen = gz_bits(gz, 5) + 257;
+     ndist = gz_bits(gz, 5) + 1;
+     ncode = gz_bits(gz, 4) + 4;
+     if (nlen > MAXLCODES || ndist > MAXDCODES)
+	  return -1;
+
+     for (index = 0; index < ncode; index++)
+	  lengths[order[index]] = gz_bits(gz, 3);
+     for (; index < 19; index++)
+	  lengths[order[index]] = 0;
+     if (gz_construct(&gz->lencode, lengths, 19) != 0)
+	  return -1;
+
+     index = 0;
+     while (index < nlen + ndist) {
+	  symbol = gz_decode(gz, &gz->lencode);
+	  if (symbol < 0 || gz->error)
+	       return -1;
+	  if (symbol < 16) {
+	       lengths[index++] = symbol;
+	       continue;
+	  }
+	  len = 0;
+	  if (symbol == 16) {
+	       if (index == 0)
+		    return -1;
+	       len = lengths[index - 1];
+	       symbol = 3 + gz_bits(gz, 2);
+	  } else if (symbol == 17)
+	       symbol = 3 + gz_bits(gz, 3);
+	  else
+	       symbol = 11 + gz_bits(gz, 7);
+	  if (index + symbol > nlen + ndist)
+	       return -1;
+	  while (symbol--)
+	       lengths[index++] = len;
+     }
+     if (lengths[256] == 0)
+	  return -1;
+
+     /* Incomplete codes are only allowed with a single code */
+     err = gz_construct(&gz->lencode, lengths, nlen);
+     if (err && (err < 0 || nlen != gz->lencode.count[0] + gz->lencode.count[1]))
+	  return -1;
+     err = gz_construct(&gz->distcode, lengths + nlen, ndist);
+     if (err && (err < 0 || ndist != gz->distcode.count[0] + gz->distcode.count[1]))
+	  return -1;
+     return 0;
+}
+
+static unsigned long
+gz_le32(struct gunzip *gz)
+{
+     unsigned long val = 0;
+     int i;
+
+     for (i = 0; i < 4; i++)
+	  val |= (unsigned long)(gz_byte(gz) & 0xff) << (8 * i);
+     return val;
+}
+
+/* Skip the gzip header and get ready to inflate the first block */
+static int
+gz_header(struct gunzip *gz)
+{
+     int flags, n;
+
+     if (gz_byte(gz) != 0x1f || gz_byte(gz) != 0x8b || gz_byte(gz) != 8)
+	  return -1;
+     flags = gz_byte(gz);
+     if (flags < 0 || (flags & GZ_FRESERVED))
+	  return -1;
+     for (n = 0; n < 6; n++)		/* mtime, xfl, os */
+	  gz_byte(gz);
+     if (flags & GZ_FEXTRA) {
+	  n = gz_byte(gz);
+	  n |= gz_byte(gz) << 8;
+	  while (n-- > 0 && !gz->error)
+	       gz_byte(gz);
+     }
+     if (flags & GZ_FNAME)
+	  while (gz_byte(gz) > 0)
+	       ;
+     if (flags & GZ_FCOMMENT)
+	  while (gz_byte(gz) > 0)
+	       ;
+     if (flags & GZ_FHCRC) {
+	  gz_byte(gz);
+	  gz_byte(gz);
+     }
+     if (gz->error)
+	  return -1;
+
+     gz->bitbuf = 0;
+     gz->bitcnt = 0;
+     gz->state = GZ_BLOCK;
+     gz->last = 0;
+     gz->stored_left = gz->copy_len = 0;
+     gz->total = 0;
+     gz->crc = 0xffffffffUL;
+     return 0;
+}
+
+/* The trailer holds the CRC and length of the data, check them */
+static void
+gz_trailer(struct gunzip *gz)
+{
+     unsigned long crc, isize;
+
+     gz->bitbuf = 0;		/* to the byte boundary */
+     gz->bitcnt = 0;
+     crc = gz_le32(gz);
+     isize = gz_le32(gz);
+     if (gz->error)
+	  return;
+     if (crc != (gz->crc ^ 0xffffffffUL)
+	 || isize != (gz->total & 0xffffffffUL)) {
+	  prom_printf("gunzip: CRC error, the image is corrupt\n");
+	  gz->error = 1;
+	  return;
+     }
+     DEBUG_F("gunzip: %lu bytes, CRC ok\n", gz->total);
+     gz->state = GZ_END;
+}
+
+#define GZ_PUT(c) do {						\
+     unsigned char __c = (c);					\
+     if (buf)							\
+	  buf[done] = __c;					\
+     done++;							\
+     gz->window[gz->total++ & GZ_WMASK] = __c;			\
+     gz->crc = crc_table[(gz->crc ^ __c) & 0xff] ^ (gz->crc >> 8); \
+} while (0)
+
+/* Inflate up to size bytes into buf, or just skip them if buf is NULL.
+ * Returns the number of bytes, short at the end of the data, or -1 if
+ * it is corrupt.
+ */
+static int
+gz_inflate(struct gunzip *gz, unsigned char *buf, unsigned int size)
+{
+     unsigned int done = 0;
+     int symbol, c, type;
+
+     while (done < size && !gz->error) {
+	  if (gz->copy_len) {
+	       while (gz->copy_len && done < size) {
+		    GZ_PUT(gz->window[(gz->total - gz->copy_dist) & GZ_WMASK]);
+		    gz->copy_len--;
+	       }
+	       continue;
+	  }
+
+	  switch (gz->state) {
+	  case GZ_BLOCK:
+	       if (gz->last) {
+		    gz_trailer(gz);
+		    break;
+	       }
+	       gz->last = gz_bits(gz, 1);
+	       type = gz_bits(gz, 2);
+	       if (type == 0) {
+		    gz->bitbuf = 0;
+		    gz->bitcnt = 0;
+		    c = gz_byte(gz);
+		    c |= gz_byte(gz) << 8;
+		    symbol = gz_byte(gz);
+		    symbol |= gz_byte(gz) << 8;
+		    if (c != (~symbol & 0xffff))
+			 gz->error = 1;
+		    gz->stored_left = c;
+		    gz->state = GZ_STORED;
+	       } else if (type == 1) {
+		    gz_fixed(gz);
+		    gz->state = GZ_CODES;
+	       } else if (type == 2 && gz_dynamic(gz) == 0)
+		    gz->state = GZ_CODES;
+	       else
+		    gz->error = 1;
+	       break;
+
+	  case GZ_STORED:
+	       if (!gz->stored_left) {
+		    gz->state = GZ_BLOCK;
+		    break;
+	       }
+	       c = gz_byte(gz);
+	       if (c < 0)
+		    break;
+	       GZ_PUT(c);
+	       gz->stored_left--;
+	       break;
+
+	  case GZ_CODES:
+	       symbol = gz_decode(gz, &gz->lencode);
+	       if (symbol < 256) {
+		    if (symbol < 0)
+			 gz->error = 1;
+		    else
+			 GZ_PUT(symbol);
+		    break;
+	       }
+	       if (symbol == 256) {
+		    gz->state = GZ_BLOCK;
+		    break;
+	       }
+	       symbol -= 257;
+	       if (symbol >= 29) {
+		    gz->error = 1;
+		    break;
+	       }
+	       gz->copy_len = length_base[symbol]
+		    + gz_bits(gz, length_extra[symbol]);
+	       symbol = gz_decode(gz, &gz->distcode);
+	       if (symbol < 0 || symbol >= 30) {
+		    gz->error = 1;
+		    break;
+	       }
+	       gz->copy_dist = dist_base[symbol]
+		    + gz_bits(gz, dist_extra[symbol]);
+	       if (gz->copy_dist > gz->total)
+		    gz->error = 1;
+	       break;
+
+	  case GZ_END:
+	       return done;
+	  }
+     }
+
+     if (gz->error) {
+	  gz->copy_len = 0;
+	  if (!done)
+	       return -1;
+     }
+     return done;
+}
+
+static int
+gunzip_read(struct boot_file_t* file, unsigned int size, void* buffer)
+{
+     struct gunzip *gz = file->priv;
+     int len;
+
+     len = gz_inflate(gz, buffer, size);
+     if (len < 0) {
+	  DEBUG_F("gunzip: corrupt data at 0x%lx\n", gz->total);
+	  return FILE_IOERR;
+     }
+     file->pos = gz->total;
+     return len;
+}
+
+static int
+gunzip_seek(struct boot_file_t* file, unsigned int newpos)
+{
+     struct gunzip *gz = file->priv;
+     unsigned int chunk;
+     int len;
+
+     if (newpos < gz->total) {
+	  DEBUG_F("gunzip: back to 0x%x, starting over\n", newpos);
+	  if (gz->raw.fs->seek(&gz->raw, 0) != FILE_ERR_OK)
+	       return FILE_CANT_SEEK;
+	  gz->in_pos = gz->in_len = 0;
+	  gz->error = 0;
+	  if (gz_header(gz))
+	       return FILE_CANT_SEEK;
+     }
+     while (gz->total < newpos) {
+	  chunk = newpos - gz->total;
+	  if (chunk > GZ_INBUF)
+	       chunk = GZ_INBUF;
+	  len = gz_inflate(gz, NULL, chunk);
+	  if (len <= 0)
+	       return FILE_CANT_SEEK;
+     }
+     file->pos = gz->total;
+     return FILE_ERR_OK;
+}
+
+static int
+gunzip_close(struct boot_file_t* file)
+{
+     struct gunzip *gz = file->priv;
+     int result;
+
+     result = gz->raw.fs->close(&gz->raw);
+     free(gz);
+     file->priv = NULL;
+     return result;
+}
+
+int
+gunzip_check(struct boot_file_t *file)
+{
+     struct gunzip *gz = file->priv;
+     int len;
+
+     while (gz->state != GZ_END) {
+	  len = gz_inflate(gz, NULL, GZ_INBUF);
+	  if (len <= 0 && gz->state != GZ_END)
+	       return 0;
+     }
+     file->pos = gz->total;
+     return !gz->error;
+}
+
+int
+gunzip_open(struct boot_file_t *file)
+{
+     unsigned char magic[4];
+     struct gunzip *gz;
+     int len;
+
+     len = file->fs->read(file, sizeof(magic), magic);
+     if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+	  gz = malloc(sizeof(struct gunzip));
+	  if (!gz)
+	       return FILE_ERR_NOMEM;
+	  memset(gz, 0, sizeof(struct gunzip));
+	  crc_init();
+
+	  /* The driver state moves into the wrapper, the bytes read
+	   * already are handed to the decoder */
+	  gz->raw = *file;
+	  memcpy(gz->in, magic, len);
+	  gz->in_len = len;
+	  if (gz_header(gz)) {
+	       *file = gz->raw;
+	       free(gz);
+	       return FILE_ERR_BAD_FSYS;
+	  }
+
+	  file->fs = &gunzip_filesystem;
+	  file->priv = gz;
+	  file->buffer = NULL;
+	  file->buffer_size = 0;
+	  file->pos = 0;
+	  file->len = 0;
+	  DEBUG_F("gunzip: inflating\n");
+	  return 1;
+     }
+
+     if (len == 4 && magic[0] == 0x28 && magic[1] == 0xb5
+	 && magic[2] == 0x2f && magic[3] == 0xfd)
+	  return FILE_ERR_BAD_TYPE;
+
+     if (file->fs->seek(file, 0) != FILE_ERR_OK)
+	  return FILE_CANT_SEEK;
+     return 0;
+}
+
+/*
+ * Local variables:
+ * c-file-style: "k&r"
+ * c-basic-offset: 5
+ * End:
+ */
@@ -63,6 +63,21 @@ static const char *valid_mac_partition_types[] = {
 #define MAX_BLOCK_SIZE	2048
 static unsigned char block_buffer[MAX_BLOCK_SIZE];
 
+/* Largest Mac partition map we read, in entries */
+#define MAX_MAC_MAP	64
+
+/* ISO volume descriptors are searched this many blocks at a time */
+#define ISO_VD_WINDOW	16
+
+/* Partition tables don't change while we run, each device is scanned once */
+struct partition_cache {
+     struct partition_cache*	next;
+     char*			device;
+     struct partition_t*	list;
+};
+
+static struct partition_cache* partition_cache;
+
 static void
 add_new_partition(struct partition_t**	list, int part_number, const char *part_type,
 		  const char *part_name, unsigned long part_start, unsigned long part_size,
@@ -93,31 +108,56 @@ partition_mac_lookup( const char *dev_name, prom_handle disk,
                       unsigned int prom_blksize, struct partition_t** list )
 {
      int block, map_size;
+     unsigned char *map;
+     struct mac_partition* part;
 
      /* block_buffer contains block 0 from the partitions_lookup() stage */
-     struct mac_partition* part = (struct mac_partition *)block_buffer;
      unsigned short ptable_block_size =
 	  ((struct mac_driver_desc *)block_buffer)->block_size;
 
-     map_size = 1;
+     /* The first entry tells how many there are, then read the rest of
+      * the map with a single request */
+     if (prom_readblocks(disk, 1, 1, block_buffer) != 1) {
+	  prom_printf("Can't read partition %d\n", 1);
+	  return;
+     }
+     part = (struct mac_partition *)block_buffer;
+     if (part->signature != MAC_PARTITION_MAGIC)
+	  return;
+     map_size = part->map_count;
+     if (map_size > MAX_MAC_MAP) {
+	  prom_printf("Only using the first %d of %d partitions\n",
+		      MAX_MAC_MAP, map_size);
+	  map_size = MAX_MAC_MAP;
+     }
+
+     map = malloc(map_size * prom_blksize);
+     if (!map) {
+	  prom_printf("Can't allocate memory\n");
+	  return;
+     }
+     memcpy(map, block_buffer, prom_blksize);
+     if (map_size > 1) {
+	  int got = prom_readblocks(disk, 2, map_size - 1, map + prom_blksize);
+	  if (got != map_size - 1) {
+	       prom_printf("Can't read partition %d\n", got < 0 ? 2 : got + 2);
+	       map_size = got < 0 ? 1 : got + 1;
+	  }
+     }
+
      for (block=1; block < map_size + 1; block++)
      {
 #ifdef CHECK_FOR_VALID_MAC_PARTITION_TYPE
 	  int valid = 0;
 	  const char *ptype;
 #endif
-	  if (prom_readblocks(disk, block, 1, block_buffer) != 1) {
-	       prom_printf("Can't read partition %d\n", block);
-	       break;
-	  }
+	  part = (struct mac_partition *)(map + (block - 1) * prom_blksize);
 	  if (part->signature != MAC_PARTITION_MAGIC) {
 #if 0
 	       prom_printf("Wrong partition %d signature\n", block);
 #endif
 	       break;
 	  }
-	  if (block == 1)
-	       map_size = part->map_count;
 
 #ifdef CHECK_FOR_VALID_MAC_PARTITION_TYPE
 	  /* We don't bother looking at swap partitions of any type,
@@ -152,6 +192,7 @@ partition_mac_lookup( const char *dev_name, prom_handle disk,
 		    ptable_block_size,
 		    0);
      }
+     free(map);
 }
 
 /*
@@ -193,28 +234,39 @@ partition_fdisk_lookup( const char *dev_name, prom_handle disk,
 static int
 identify_iso_fs(ihandle device, unsigned int *iso_root_block)
 {
-     int block;
+     int block, i, got;
+     unsigned char *window;
 
-     for (block = 16; block < 100; block++) {
-	  struct iso_volume_descriptor  * vdp;
+     window = malloc(ISO_VD_WINDOW * 2048);
+     if (!window)
+	  return 0;
 
-	  if (prom_readblocks(device, block, 1, block_buffer) != 1) {
+     for (block = 16; block < 100; block += ISO_VD_WINDOW) {
+	  got = prom_readblocks(device, block, ISO_VD_WINDOW, window);
+	  if (got <= 0) {
 	       prom_printf("Can't read volume desc block %d\n", block);
 	       break;
 	  }
 
-	  vdp = (struct iso_volume_descriptor *)block_buffer;
-
-	  /* Due to the overlapping physical location of the descriptors,
-	   * ISO CDs can match hdp->id==HS_STANDARD_ID as well. To ensure
-	   * proper identification in this case, we first check for ISO.
-	   */
-	  if (strncmp (vdp->id, ISO_STANDARD_ID, sizeof vdp->id) == 0) {
-	       *iso_root_block = block;
-	       return 1;
+	  for (i = 0; i < got && block + i < 100; i++) {
+	       struct iso_volume_descriptor *vdp =
+		    (struct iso_volume_descriptor *)(window + i * 2048);
+
+	       /* Due to the overlapping physical location of the descriptors,
+		* ISO CDs can match hdp->id==HS_STANDARD_ID as well. To ensure
+		* proper identification in this case, we first check for ISO.
+		*/
+	       if (strncmp (vdp->id, ISO_STANDARD_ID, sizeof vdp->id) == 0) {
+		    *iso_root_block = block + i;
+		    free(window);
+		    return 1;
+	       }
 	  }
+	  if (got < ISO_VD_WINDOW)
+	       break;
      }
 
+     free(window);
      return 0;
 }
 
@@ -329,13 +381,16 @@ partition_amiga_lookup( const char *dev_name, prom_handle disk,
 		free(used);
 }
 
-struct partition_t*
-partitions_lookup(const char *device)
+/* Scan the partition table of device into *list.  Returns 0 if the device
+ * couldn't be read, the result is then not worth remembering.
+ */
+static int
+partitions_read(const char *device, struct partition_t** list)
 {
      ihandle	disk;
      struct mac_driver_desc *desc = (struct mac_driver_desc *)block_buffer;
-     struct partition_t* list = NULL;
      unsigned int prom_blksize, iso_root_block;
+     int ok = 0;
 
      strncpy((char *)block_buffer, device, 2040);
      if (_machine != _MACH_bplan)
@@ -345,7 +400,7 @@ partitions_lookup(const char *device)
      disk = prom_open((char *)block_buffer);
      if (disk == NULL) {
 	  prom_printf("Can't open device <%s>\n", block_buffer);
-	  goto bail;
+	  return 0;
      }
      prom_blksize = prom_getblksize(disk);
      DEBUG_F("block size of device is %d\n", prom_blksize);
@@ -362,14 +417,15 @@ partitions_lookup(const char *device)
 	  prom_printf("Can't read boot blocks\n");
 	  goto bail;
      }
+     ok = 1;
      if (desc->signature == MAC_DRIVER_MAGIC) {
 	  /* pdisk partition format */
-	  partition_mac_lookup(device, disk, prom_blksize, &list);
+	  partition_mac_lookup(device, disk, prom_blksize, list);
      } else if ((block_buffer[510] == 0x55) && (block_buffer[511] == 0xaa)) {
 	  /* fdisk partition format */
-	  partition_fdisk_lookup(device, disk, prom_blksize, &list);
+	  partition_fdisk_lookup(device, disk, prom_blksize, list);
      } else if (prom_blksize == 2048 && identify_iso_fs(disk, &iso_root_block)) {
-	  add_new_partition(&list,
+	  add_new_partition(list,
 			    0,
 			    '\0',
 			    '\0',
@@ -380,7 +436,7 @@ partitions_lookup(const char *device)
 	  prom_printf("ISO9660 disk\n");
      } else if (_amiga_find_rdb(device, disk, prom_blksize) != -1) {
 	  /* amiga partition format */
-	  partition_amiga_lookup(device, disk, prom_blksize, &list);
+	  partition_amiga_lookup(device, disk, prom_blksize, list);
      } else {
 	  prom_printf("No supported partition table detected\n");
 	  goto bail;
@@ -389,6 +445,33 @@ partitions_lookup(const char *device)
 bail:
      prom_close(disk);
 
+     return ok;
+}
+
+/* The returned list belongs to the partition cache, don't free it */
+struct partition_t*
+partitions_lookup(const char *device)
+{
+     struct partition_cache* c;
+     struct partition_t* list = NULL;
+     struct arena* prev;
+
+     for (c = partition_cache; c; c = c->next)
+	  if (!strcmp(c->device, device))
+	       return c->list;
+
+     prev = arena_enter(&arena_long);
+     if (partitions_read(device, &list)) {
+	  c = malloc(sizeof(struct partition_cache));
+	  if (c) {
+	       c->device = strdup(device);
+	       c->list = list;
+	       c->next = partition_cache;
+	       if (c->device)
+		    partition_cache = c;
+	  }
+     }
+     arena_leave(prev);
      return list;
 }
 
@@ -408,7 +491,7 @@ get_part_type(char *device, int partition)
      found = NULL;
 
      if (!parts)
-	  return '\0';
+	  return NULL;
 
      for (p = parts; p && !found; p=p->next) {
 	  DEBUG_F("number: %02d, start: 0x%08lx, length: 0x%08lx, type: %s, name: %s\n",
@@ -418,24 +501,9 @@ get_part_type(char *device, int partition)
 	       break;
 	  }
      }
-     if (parts)
-	  partitions_free(parts);
      return type;
 }
 
-/* Freed in reverse order of allocation to help malloc'ator */
-void
-partitions_free(struct partition_t* list)
-{
-     struct partition_t*	next;
-
-     while(list) {
-	  next = list->next;
-	  free(list);
-	  list = next;
-     }
-}
-
 
 /*
  * Local variables:
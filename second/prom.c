@@ -46,6 +46,12 @@ ihandle prom_stdin, prom_stdout;
 static ihandle prom_mem, prom_mmu;
 static ihandle prom_chosen, prom_options;
 
+/* Cache block sizes of the boot cpu, for flush_icache_range() */
+unsigned int dcache_line_size = 32;
+unsigned int icache_line_size = 32;
+unsigned int dcbz_line_size;
+int vmx_enabled;
+
 struct prom_args {
      const char *service;
      int nargs;
@@ -221,6 +227,93 @@ prom_get_devtype (char *device)
      }
 }
 
+/* The node of the cpu we run on, or of the first one */
+static prom_handle
+prom_cpu_node(void)
+{
+     prom_handle cpu;
+     ihandle ih;
+
+     if (prom_get_chosen("cpu", &ih, sizeof(ih)) > 0) {
+	  cpu = call_prom("instance-to-package", 1, 1, ih);
+	  if (cpu != PROM_INVALID_HANDLE && cpu != 0)
+	       return cpu;
+     }
+     cpu = prom_finddevice("/cpus");
+     if (cpu == PROM_INVALID_HANDLE)
+	  return cpu;
+     cpu = call_prom("child", 1, 1, cpu);
+     return cpu ? cpu : PROM_INVALID_HANDLE;
+}
+
+/* Read a cache block size property, keeping the default unless it is
+ * a sane power of two.  Returns 1 if the property was used. */
+static int
+prom_cache_size(prom_handle cpu, char *name, unsigned int *size)
+{
+     unsigned int val;
+
+     if (prom_getprop(cpu, name, &val, sizeof(val)) != sizeof(val)
+	 || val < 16 || val > 1024 || (val & (val - 1)))
+	  return 0;
+     *size = val;
+     return 1;
+}
+
+/* What dcbz really clears, which isn't always the cache block size: a
+ * 970 left in dcbz32 mode clears 32 bytes of its 128.  Clear a block
+ * in a poisoned buffer and count. */
+static unsigned int
+prom_dcbz_size(void)
+{
+     static unsigned char probe[2048] __attribute__ ((aligned (1024)));
+     unsigned int i, n;
+
+     memset(probe, 0xff, sizeof(probe));
+     __asm__ __volatile__ ("dcbz 0,%0" : : "r" (probe) : "memory");
+     for (n = 0; n < sizeof(probe) && probe[n] == 0; n++)
+	  ;
+     for (i = n; i < sizeof(probe); i++)
+	  if (probe[i] != 0xff)
+	       return 0;
+     return n;
+}
+
+/* Find out what we need to know about the cpu */
+static void
+prom_cpu_init(void)
+{
+     prom_handle cpu = prom_cpu_node();
+
+     if (cpu == PROM_INVALID_HANDLE)
+	  return;
+     /* memset and memcpy only use dcbz when the firmware told us the
+      * block size and dcbz is seen to clear exactly that */
+     if (prom_cache_size(cpu, "d-cache-block-size", &dcache_line_size)
+	 && dcache_line_size >= 32) {
+	  unsigned int size = prom_dcbz_size();
+	  if (size == dcache_line_size)
+	       dcbz_line_size = size;
+	  else
+	       DEBUG_F("dcbz clears %u bytes, not using it\n", size);
+     }
+     prom_cache_size(cpu, "i-cache-block-size", &icache_line_size);
+     DEBUG_F("cache blocks: d %u, i %u, dcbz %u\n",
+	     dcache_line_size, icache_line_size, dcbz_line_size);
+
+     /* Apple firmware has an empty "altivec" property, IBM's says
+      * which VMX level in "ibm,vmx" */
+     if (prom_getproplen(cpu, "altivec") >= 0)
+	  vmx_enabled = 1;
+     else {
+	  unsigned int vmx;
+	  if (prom_getprop(cpu, "ibm,vmx", &vmx, sizeof(vmx)) == sizeof(vmx)
+	      && vmx >= 1)
+	       vmx_enabled = 1;
+     }
+     DEBUG_F("altivec: %s\n", vmx_enabled ? "yes" : "no");
+}
+
 void
 prom_init (prom_entry pp)
 {
@@ -242,6 +335,8 @@ prom_init (prom_entry pp)
      yaboot_debug = 0;
      prom_get_options("linux,yaboot-debug", &yaboot_debug, sizeof(yaboot_debug));
 
+     prom_cpu_init();
+
   // move cursor to fresh line
      prom_printf ("\n");
 
@@ -351,6 +446,17 @@ prom_getblksize (prom_handle file)
      return (int)call_method_1 ("block-size", file, 0);
 }
 
+/* "size" returns a double, high cell on top.  0 when not supported. */
+unsigned long long
+prom_getsize (prom_handle file)
+{
+     void *hi = 0, *lo = 0;
+
+     if (call_prom_return ("call-method", 2, 3, "size", file, &hi, &lo) != 0)
+	  return 0;
+     return ((unsigned long long)(unsigned long)hi << 32) | (unsigned long)lo;
+}
+
 int
 prom_readblocks (prom_handle dev, int blockNum, int blockCount, void *buffer)
 {
@@ -580,6 +686,290 @@ prom_sleep (int seconds)
      while (prom_getms() <= end);
 }
 
+/*
+ * Free memory map.  The /memory "available" property is read once and
+ * then kept up to date as we claim and release, so a claim can go
+ * straight to a range that fits rather than probing the firmware at
+ * every step of the address space.
+ */
+
+/* We call this too early to use malloc, 128 cells should be large enough */
+#define NR_AVAILABLE	128
+#define NR_RANGES	(NR_AVAILABLE / 2)
+#define CLAIM_ALIGN	0x1000
+
+struct prom_range {
+     unsigned long start;
+     unsigned long end;
+};
+
+static struct prom_range prom_free[NR_RANGES];
+static int prom_nfree = -1;		/* -1 until the map has been read */
+static int prom_avail_ok;		/* the map was read and is kept */
+static unsigned long prom_ceiling;	/* claims stay below this */
+
+/* Read a /memory ranges property ("reg" or "available"), keeping what
+ * lies below 4GB, unsorted */
+static int
+prom_get_ranges(char *prop, struct prom_range *ranges, int max)
+{
+     prom_handle root;
+     unsigned int addr_cells, size_cells;
+     ihandle mem;
+     unsigned int available[NR_AVAILABLE];
+     int len, i, n = 0;
+     unsigned int *p;
+
+     root = prom_finddevice("/");
+     if (!root)
+          return 0;
+
+     addr_cells = 2;
+     prom_getprop(root, "#address-cells", &addr_cells, sizeof(addr_cells));
+
+     size_cells = 1;
+     prom_getprop(root, "#size-cells", &size_cells, sizeof(size_cells));
+
+     mem = prom_finddevice("/memory@0");
+     if (mem == PROM_INVALID_HANDLE)
+          return 0;
+
+     len = prom_getprop(mem, prop, available, sizeof(available));
+     if (len <= 0)
+          return 0;
+     len /= 4;
+
+     p = available;
+     while (len >= (int)(addr_cells + size_cells) && n < max) {
+          unsigned long addr, size, addr_hi = 0, size_hi = 0;
+
+          /*
+           * Since we are in 32bit mode only ranges starting below 4GB
+           * are of any use, and those are clipped to it.
+           */
+          for (i = 1; i < addr_cells; i++)
+               addr_hi |= *p++;
+          addr = *p++;
+          for (i = 1; i < size_cells; i++)
+               size_hi |= *p++;
+          size = *p++;
+          len -= addr_cells + size_cells;
+
+          if (addr_hi || !size)
+               continue;
+          ranges[n].start = addr;
+          if (size_hi || addr + size < addr)
+               ranges[n].end = ~(CLAIM_ALIGN - 1);
+          else
+               ranges[n].end = addr + size;
+          n++;
+     }
+     return n;
+}
+
+/*
+ * The first /memory "reg" range is the memory the firmware maps for
+ * us in real mode (the RMA on IBM machines), everything we claim must
+ * be within it.  Without one we keep to the historical 256MB.
+ */
+unsigned long
+prom_claim_ceiling(void)
+{
+     struct prom_range reg;
+
+     if (prom_ceiling)
+          return prom_ceiling;
+
+     prom_ceiling = PROM_CLAIM_MAX_ADDR;
+     if (prom_get_ranges("reg", &reg, 1) == 1 && reg.start == 0
+         && reg.end > PROM_CLAIM_MAX_ADDR)
+          prom_ceiling = reg.end;
+     prom_debug("claim ceiling 0x%08lx (%ld MB)\n", prom_ceiling,
+                prom_ceiling/1024/1024);
+     return prom_ceiling;
+}
+
+static void
+prom_avail_read(void)
+{
+     struct prom_range r;
+     unsigned long ceiling = prom_claim_ceiling();
+     int i, j, n;
+
+     n = prom_get_ranges("available", prom_free, NR_RANGES);
+
+     /* Sort by address and drop what we may not claim */
+     prom_nfree = 0;
+     for (i = 0; i < n; i++) {
+          r = prom_free[i];
+          if (r.start >= ceiling)
+               continue;
+          if (r.end > ceiling)
+               r.end = ceiling;
+          for (j = prom_nfree; j > 0 && prom_free[j - 1].start > r.start; j--)
+               prom_free[j] = prom_free[j - 1];
+          prom_free[j] = r;
+          prom_nfree++;
+     }
+     /* Without a single range there was no map to keep: probe instead.
+      * Once there was one, it stays in use even when claims empty it. */
+     prom_avail_ok = prom_nfree > 0;
+     DEBUG_F("%d free memory ranges\n", prom_nfree);
+}
+
+static int
+prom_avail_ready(void)
+{
+     if (prom_nfree < 0)
+          prom_avail_read();
+     return prom_avail_ok;
+}
+
+/* Size of the largest free range, 0 if the map can't be read */
+unsigned long
+prom_largest_free(void)
+{
+     unsigned long largest = 0;
+     int i;
+
+     if (!prom_avail_ready())
+          return 0;
+     for (i = 0; i < prom_nfree; i++)
+          if (prom_free[i].end - prom_free[i].start > largest)
+               largest = prom_free[i].end - prom_free[i].start;
+     return largest;
+}
+
+/* Remove [start, start + size) from the free map */
+static void
+prom_range_take(unsigned long start, unsigned long size)
+{
+     unsigned long end = start + size;
+     struct prom_range *r;
+     int i;
+
+     for (i = 0; i < prom_nfree; i++) {
+          r = &prom_free[i];
+          if (end <= r->start || start >= r->end)
+               continue;
+          if (start > r->start && end < r->end) {
+               /* With no slot for the tail it is simply forgotten */
+               if (prom_nfree < NR_RANGES) {
+                    memmove(r + 2, r + 1, (prom_nfree - i - 1) * sizeof(*r));
+                    r[1].start = end;
+                    r[1].end = r->end;
+                    prom_nfree++;
+                    i++;
+               }
+               r->end = start;
+          } else if (start <= r->start && end >= r->end) {
+               memmove(r, r + 1, (prom_nfree - i - 1) * sizeof(*r));
+               prom_nfree--;
+               i--;
+          } else if (start <= r->start)
+               r->start = end;
+          else
+               r->end = start;
+     }
+}
+
+/* Put [start, start + size) back in the free map */
+static void
+prom_range_give(unsigned long start, unsigned long size)
+{
+     unsigned long end = start + size;
+     struct prom_range *r;
+     int i;
+
+     if (start >= prom_ceiling)
+          return;
+     if (end > prom_ceiling)
+          end = prom_ceiling;
+
+     for (i = 0; i < prom_nfree && prom_free[i].start < start; i++)
+          ;
+     r = &prom_free[i];
+     if (i > 0 && r[-1].end >= start) {
+          r--;
+          if (end > r->end)
+               r->end = end;
+     } else {
+          if (prom_nfree == NR_RANGES)
+               return;
+          memmove(r + 1, r, (prom_nfree - i) * sizeof(*r));
+          r->start = start;
+          r->end = end;
+          prom_nfree++;
+     }
+
+     /* Swallow the ranges it now reaches */
+     while (r + 1 < prom_free + prom_nfree && r[1].start <= r->end) {
+          if (r[1].end > r->end)
+               r->end = r[1].end;
+          memmove(r + 1, r + 2,
+                  (prom_free + prom_nfree - (r + 2)) * sizeof(*r));
+          prom_nfree--;
+     }
+}
+
+/* Lowest address at or above min, or highest one if top is set, where
+ * size bytes fit in a free range.  -1 if there is none. */
+static unsigned long
+prom_range_fit(unsigned long min, unsigned long size, unsigned long align,
+               int top)
+{
+     unsigned long addr;
+     struct prom_range *r;
+     int i;
+
+     if (align < CLAIM_ALIGN)
+          align = CLAIM_ALIGN;
+
+     for (i = 0; i < prom_nfree; i++) {
+          r = &prom_free[top ? prom_nfree - 1 - i : i];
+          if (r->end - r->start < size)
+               continue;
+          if (top) {
+               addr = (r->end - size) & ~(align - 1);
+               if (addr >= r->start && addr >= min)
+                    return addr;
+          } else {
+               addr = r->start > min ? r->start : min;
+               addr = (addr + align - 1) & ~(align - 1);
+               if (addr >= r->start && addr < r->end && r->end - addr >= size)
+                    return addr;
+          }
+     }
+     return (unsigned long)-1;
+}
+
+/* Claim size bytes where the free map says they fit.  Should the
+ * firmware disagree, the map is read again and the search retried once.
+ */
+static void *
+prom_claim_fit(unsigned long min, unsigned int size, unsigned int align,
+               int top)
+{
+     unsigned long addr;
+     void *found;
+     int tries;
+
+     for (tries = 0; tries < 2; tries++) {
+          if (tries)
+               prom_avail_read();
+          addr = prom_range_fit(min, size, align, top);
+          if (addr == (unsigned long)-1)
+               continue;
+          found = call_prom("claim", 3, 1, addr, size, 0);
+          if (found != (void *)-1) {
+               prom_debug("claim of 0x%x at 0x%x returned 0x%x\n", size, (int)addr, (int)found);
+               prom_range_take((unsigned long)found, size);
+               return found;
+          }
+     }
+     return (void *)-1;
+}
+
 /* if address given is claimed look for other addresses to get the needed
  * space before giving up
  */
@@ -587,15 +977,23 @@ void *
 prom_claim_chunk(void *virt, unsigned int size, unsigned int align)
 {
      void *found, *addr;
-     for(addr=virt; addr <= (void*)PROM_CLAIM_MAX_ADDR;
-         addr+=(0x100000/sizeof(addr))) {
-          found = call_prom("claim", 3, 1, addr, size, 0);
-          if (found != (void *)-1) {
-               prom_debug("claim of 0x%x at 0x%x returned 0x%x\n", size, (int)addr, (int)found);
-               return(found);
+
+     if (prom_avail_ready()) {
+          found = prom_claim_fit((unsigned long)virt, size, align, 0);
+          if (found != (void *)-1)
+               return found;
+     } else {
+          /* No memory map, probe for it */
+          for(addr=virt; addr <= (void*)prom_claim_ceiling();
+              addr+=(0x100000/sizeof(addr))) {
+               found = call_prom("claim", 3, 1, addr, size, 0);
+               if (found != (void *)-1) {
+                    prom_debug("claim of 0x%x at 0x%x returned 0x%x\n", size, (int)addr, (int)found);
+                    return(found);
+               }
           }
      }
-     prom_printf("ERROR: claim of 0x%x in range 0x%x-0x%x failed\n", size, (int)virt, PROM_CLAIM_MAX_ADDR);
+     prom_printf("ERROR: claim of 0x%x in range 0x%x-0x%lx failed\n", size, (int)virt, prom_claim_ceiling());
      return((void*)-1);
 }
 
@@ -604,18 +1002,58 @@ void *
 prom_claim_chunk_top(unsigned int size, unsigned int align)
 {
      void *found, *addr;
-     for(addr=(void*)PROM_CLAIM_MAX_ADDR; addr >= (void *)size;
-         addr-=(0x100000/sizeof(addr))) {
-          found = call_prom("claim", 3, 1, addr, size, 0);
-          if (found != (void *)-1) {
-               prom_debug("claim of 0x%x at 0x%x returned 0x%x\n", size, (int)addr, (int)found);
-               return(found);
+
+     if (prom_avail_ready()) {
+          found = prom_claim_fit(0, size, align, 1);
+          if (found != (void *)-1)
+               return found;
+     } else {
+          for(addr=(void*)prom_claim_ceiling(); addr >= (void *)size;
+              addr-=(0x100000/sizeof(addr))) {
+               found = call_prom("claim", 3, 1, addr, size, 0);
+               if (found != (void *)-1) {
+                    prom_debug("claim of 0x%x at 0x%x returned 0x%x\n", size, (int)addr, (int)found);
+                    return(found);
+               }
           }
      }
-     prom_printf("ERROR: claim of 0x%x in range 0x0-0x%x failed\n", size, PROM_CLAIM_MAX_ADDR);
+     prom_printf("ERROR: claim of 0x%x in range 0x0-0x%lx failed\n", size, prom_claim_ceiling());
      return((void*)-1);
 }
 
+/* Claim all of the first free range from virt on that has at least min
+ * bytes, for loads whose size is only known once done.  The size
+ * claimed is returned in *size.
+ */
+void *
+prom_claim_rest(void *virt, unsigned int min, unsigned int *size)
+{
+     unsigned long addr;
+     struct prom_range *r;
+     void *found;
+     int i;
+
+     if (!prom_avail_ready())
+          return (void *)-1;
+
+     for (i = 0; i < prom_nfree; i++) {
+          r = &prom_free[i];
+          addr = r->start > (unsigned long)virt ? r->start : (unsigned long)virt;
+          addr = (addr + CLAIM_ALIGN - 1) & ~(CLAIM_ALIGN - 1);
+          if (addr >= r->end || r->end - addr < min)
+               continue;
+          *size = r->end - addr;
+          found = call_prom("claim", 3, 1, addr, *size, 0);
+          if (found != (void *)-1) {
+               prom_debug("claim of 0x%x at 0x%x returned 0x%x\n", *size, (int)addr, (int)found);
+               prom_range_take((unsigned long)found, *size);
+               return found;
+          }
+     }
+     prom_printf("ERROR: no free range of 0x%x bytes above 0x%x\n", min, (int)virt);
+     return (void *)-1;
+}
+
 void *
 prom_claim (void *virt, unsigned int size, unsigned int align)
 {
@@ -624,8 +1062,10 @@ prom_claim (void *virt, unsigned int size, unsigned int align)
      ret = call_prom ("claim", 3, 1, virt, size, align);
      if (ret == (void *)-1)
           prom_printf("ERROR: claim of 0x%x at 0x%x failed\n", size, (int)virt);
-     else
+     else {
           prom_debug("claim of 0x%x at 0x%x returned 0x%x\n", size, (int)virt, (int)ret);
+          prom_range_take((unsigned long)ret, size);
+     }
 
      return ret;
 }
@@ -637,6 +1077,8 @@ prom_release(void *virt, unsigned int size)
 
      ret = call_prom ("release", 2, 0, virt, size);
      prom_debug("release of 0x%x at 0x%x returned 0x%x\n", size, (int)virt, (int)ret);
+     if (prom_avail_ok)
+          prom_range_give((unsigned long)virt, size);
 }
 
 void
@@ -796,66 +1238,23 @@ char * prom_get_ip (struct bootp_packet * packet)
      return conf_path;
 }
 
-/* We call this too early to use malloc, 128 cells should be large enough */
-#define NR_AVAILABLE 128
-
 void prom_print_available(void)
 {
-     prom_handle root;
-     unsigned int addr_cells, size_cells;
-     ihandle mem;
-     unsigned int available[NR_AVAILABLE];
-     unsigned int len;
-     unsigned int *p;
+     struct prom_range ranges[NR_RANGES];
+     int i, n;
 
      if (!yaboot_debug)
           return;
 
-     root = prom_finddevice("/");
-     if (!root)
+     n = prom_get_ranges("available", ranges, NR_RANGES);
+     if (!n)
           return;
 
-     addr_cells = 2;
-     prom_getprop(root, "#address-cells", &addr_cells, sizeof(addr_cells));
-
-     size_cells = 1;
-     prom_getprop(root, "#size-cells", &size_cells, sizeof(size_cells));
-
-     mem = prom_finddevice("/memory@0");
-     if (mem == PROM_INVALID_HANDLE)
-          return;
-
-     len = prom_getprop(mem, "available", available, sizeof(available));
-     if (len == -1)
-          return;
-     len /= 4;
-
      prom_printf("\nAvailable memory ranges:\n");
-
-     p = available;
-     while (len > 0) {
-          unsigned int addr, size;
-
-          /*
-           * Since we are in 32bit mode it should be safe to only print the
-           * bottom 32bits of each range.
-           */
-          p += (addr_cells - 1);
-          addr = *p;
-          p++;
-
-          p += (size_cells - 1);
-          size = *p;
-          p++;
-
-          if (size)
-               prom_printf("0x%08x-0x%08x (%3d MB)\n", addr, addr + size,
-                           size/1024/1024);
-
-          len -= (addr_cells + size_cells);
-     }
-
-     prom_printf("\n");
+     for (i = 0; i < n; i++)
+          prom_printf("0x%08lx-0x%08lx (%3ld MB)\n", ranges[i].start,
+                      ranges[i].end, (ranges[i].end - ranges[i].start)/1024/1024);
+     prom_printf("Claims limited to below 0x%08lx\n\n", prom_claim_ceiling());
 }
 
 /*
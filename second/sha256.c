@@ -0,0 +1,391 @@
+/*
+ *  sha256.c - SHA-256 and checking files against it as they are read
+ *
+ *  Kernels and ramdisks are checked against their SHA-256 without a
+ *  second pass over them: the file is wrapped so every read hashes the
+ *  data it returns, a slice at a time while it is still in the cache.
+ *  Parts of the file the loader skips are read and hashed on the way
+ *  past, and whatever is left when the caller is done is read at the
+ *  end, so the digest covers the whole file as sha256sum computes it.
+ *
+ *  See FIPS 180-4 for a description of the algorithm.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifdef TEST
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <time.h>
+# include "../include/sha256.h"
+#else
+# include "stdlib.h"
+# include "string.h"
+# include "file.h"
+# include "fs.h"
+# include "sha256.h"
+# include "errors.h"
+# include "debug.h"
+#endif
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define S0(x)		(ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define S1(x)		(ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define G0(x)		(ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define G1(x)		(ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+static const unsigned int K[64] = {
+     0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+     0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+     0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+     0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+     0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+     0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+     0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+     0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+     0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+     0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+     0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* The message schedule is kept 16 words deep and extended in place */
+#define W(i)	(w[(i) & 15])
+#define ROUND(a, b, c, d, e, f, g, h, i) do {				\
+     if ((i) >= 16)							\
+	  W(i) += G1(W((i) - 2)) + W((i) - 7) + G0(W((i) - 15));	\
+     t1 = h + S1(e) + CH(e, f, g) + K[i] + W(i);			\
+     d += t1;								\
+     h = t1 + S0(a) + MAJ(a, b, c);					\
+} while (0)
+
+static void
+sha256_block(unsigned int *state, const unsigned char *p)
+{
+     unsigned int a, b, c, d, e, f, g, h, t1, w[16];
+     int i;
+
+     for (i = 0; i < 16; i++, p += 4)
+	  w[i] = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+
+     a = state[0]; b = state[1]; c = state[2]; d = state[3];
+     e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+     for (i = 0; i < 64; i += 8) {
+	  ROUND(a, b, c, d, e, f, g, h, i);
+	  ROUND(h, a, b, c, d, e, f, g, i + 1);
+	  ROUND(g, h, a, b, c, d, e, f, i + 2);
+	  ROUND(f, g, h, a, b, c, d, e, i + 3);
+	  ROUND(e, f, g, h, a, b, c, d, i + 4);
+	  ROUND(d, e, f, g, h, a, b, c, i + 5);
+	  ROUND(c, d, e, f, g, h, a, b, i + 6);
+	  ROUND(b, c, d, e, f, g, h, a, i + 7);
+     }
+
+     state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+     state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void
+sha256_init(struct sha256_ctx *ctx)
+{
+     static const unsigned int init[8] = {
+	  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+     };
+
+     memcpy(ctx->state, init, sizeof(init));
+     ctx->count = 0;
+}
+
+void
+sha256_update(struct sha256_ctx *ctx, const void *data, unsigned long len)
+{
+     const unsigned char *p = data;
+     unsigned int fill = ctx->count & 63, n;
+
+     ctx->count += len;
+     if (fill) {
+	  n = 64 - fill;
+	  if (n > len)
+	       n = len;
+	  memcpy(ctx->buf + fill, p, n);
+	  p += n;
+	  len -= n;
+	  if (fill + n < 64)
+	       return;
+	  sha256_block(ctx->state, ctx->buf);
+     }
+     for (; len >= 64; p += 64, len -= 64)
+	  sha256_block(ctx->state, p);
+     if (len)
+	  memcpy(ctx->buf, p, len);
+}
+
+void
+sha256_final(struct sha256_ctx *ctx, unsigned char *digest)
+{
+     unsigned long long bits = ctx->count << 3;
+     unsigned int fill = ctx->count & 63;
+     int i;
+
+     ctx->buf[fill++] = 0x80;
+     if (fill > 56) {
+	  memset(ctx->buf + fill, 0, 64 - fill);
+	  sha256_block(ctx->state, ctx->buf);
+	  fill = 0;
+     }
+     memset(ctx->buf + fill, 0, 56 - fill);
+     for (i = 0; i < 8; i++)
+	  ctx->buf[56 + i] = bits >> (56 - 8 * i);
+     sha256_block(ctx->state, ctx->buf);
+
+     for (i = 0; i < 32; i++)
+	  digest[i] = ctx->state[i >> 2] >> (24 - 8 * (i & 3));
+}
+
+int
+sha256_match(const void *data, unsigned long len, const unsigned char *digest)
+{
+     struct sha256_ctx ctx;
+     unsigned char got[SHA256_DIGEST_SIZE];
+
+     sha256_init(&ctx);
+     sha256_update(&ctx, data, len);
+     sha256_final(&ctx, got);
+     return !memcmp(got, digest, SHA256_DIGEST_SIZE);
+}
+
+#ifndef TEST
+
+/* Reads are split in slices this big, each hashed right after it came
+ * in while it is still in the cache */
+#define SHA256_SLICE	0x40000
+/* For the parts of the file that are only hashed */
+#define SHA256_SCRATCH	0x4000
+
+struct sha256_file {
+     struct boot_file_t	raw;		/* the file being hashed */
+     struct sha256_ctx	ctx;		/* ctx.count is how far it got */
+     unsigned char	*scratch;
+};
+
+static int sha256_read(struct boot_file_t* file, unsigned int size, void* buffer);
+static int sha256_seek(struct boot_file_t* file, unsigned int newpos);
+static int sha256_close(struct boot_file_t* file);
+static unsigned int sha256_ino_size(struct boot_file_t* file);
+
+const struct fs_t sha256_filesystem =
+{
+     "sha256",
+     NULL,
+     sha256_read,
+     sha256_seek,
+     sha256_close,
+     sha256_ino_size,
+     NULL,
+     NULL
+};
+
+/* Hash the file from where the hash got to up to pos, or the end */
+static int
+sha256_skip(struct sha256_file *sf, unsigned long long pos)
+{
+     unsigned long long left;
+     int got;
+
+     if (sf->raw.fs->seek(&sf->raw, sf->ctx.count) != FILE_ERR_OK)
+	  return 0;
+     while (sf->ctx.count < pos) {
+	  left = pos - sf->ctx.count;
+	  got = sf->raw.fs->read(&sf->raw, left > SHA256_SCRATCH ? SHA256_SCRATCH : left,
+				 sf->scratch);
+	  if (got <= 0)
+	       break;
+	  sha256_update(&sf->ctx, sf->scratch, got);
+     }
+     return 1;
+}
+
+static int
+sha256_read(struct boot_file_t* file, unsigned int size, void* buffer)
+{
+     struct sha256_file *sf = file->priv;
+     unsigned char *p = buffer;
+     unsigned int done = 0, chunk;
+     unsigned long long end;
+     int got = 0;
+
+     while (done < size) {
+	  chunk = size - done;
+	  if (chunk > SHA256_SLICE)
+	       chunk = SHA256_SLICE;
+	  got = sf->raw.fs->read(&sf->raw, chunk, p + done);
+	  if (got <= 0)
+	       break;
+
+	  /* Reads start at or before where the hash got to, a seek
+	   * further on hashes what is in between first */
+	  end = file->pos + got;
+	  if (end > sf->ctx.count && file->pos <= sf->ctx.count)
+	       sha256_update(&sf->ctx, p + done + (sf->ctx.count - file->pos),
+			     end - sf->ctx.count);
+	  file->pos = end;
+	  done += got;
+	  if (got < chunk)
+	       break;
+     }
+     return done ? done : got;
+}
+
+static int
+sha256_seek(struct boot_file_t* file, unsigned int newpos)
+{
+     struct sha256_file *sf = file->priv;
+
+     if (newpos > sf->ctx.count && !sha256_skip(sf, newpos))
+	  return FILE_CANT_SEEK;
+     if (sf->raw.fs->seek(&sf->raw, newpos) != FILE_ERR_OK)
+	  return FILE_CANT_SEEK;
+     file->pos = newpos;
+     return FILE_ERR_OK;
+}
+
+static unsigned int
+sha256_ino_size(struct boot_file_t* file)
+{
+     struct sha256_file *sf = file->priv;
+
+     return sf->raw.fs->ino_size ? sf->raw.fs->ino_size(&sf->raw) : 0;
+}
+
+static int
+sha256_close(struct boot_file_t* file)
+{
+     struct sha256_file *sf = file->priv;
+     int result;
+
+     result = sf->raw.fs->close(&sf->raw);
+     free(sf->scratch);
+     free(sf);
+     file->priv = NULL;
+     return result;
+}
+
+struct sha256_file *
+sha256_open(struct boot_file_t *file)
+{
+     struct sha256_file *sf;
+
+     sf = malloc(sizeof(struct sha256_file));
+     if (!sf)
+	  return NULL;
+     sf->scratch = malloc(SHA256_SCRATCH);
+     if (!sf->scratch) {
+	  free(sf);
+	  return NULL;
+     }
+     sha256_init(&sf->ctx);
+
+     /* The driver state moves into the wrapper */
+     sf->raw = *file;
+     file->fs = &sha256_filesystem;
+     file->priv = sf;
+     file->buffer = NULL;
+     file->buffer_size = 0;
+     file->pos = 0;
+     return sf;
+}
+
+int
+sha256_check(struct sha256_file *sf, const unsigned char *digest)
+{
+     unsigned char got[SHA256_DIGEST_SIZE];
+
+     if (!sha256_skip(sf, ~0ULL))
+	  return 0;
+     DEBUG_F("hashed 0x%Lx bytes\n", sf->ctx.count);
+     sha256_final(&sf->ctx, got);
+     return !memcmp(got, digest, SHA256_DIGEST_SIZE);
+}
+
+#else /* TEST */
+
+/* Known answers from FIPS 180-4, then the throughput of the block
+ * function on the host:
+ *	gcc -O2 -DTEST -o sha256-test second/sha256.c && ./sha256-test
+ */
+static void
+test(const char *input, unsigned long repeat, const char *expected)
+{
+     struct sha256_ctx ctx;
+     unsigned char digest[SHA256_DIGEST_SIZE];
+     char result[2 * SHA256_DIGEST_SIZE + 1];
+     int i;
+
+     sha256_init(&ctx);
+     while (repeat--)
+	  sha256_update(&ctx, input, strlen(input));
+     sha256_final(&ctx, digest);
+     for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+	  sprintf(result + 2 * i, "%02x", digest[i]);
+
+     if (strcmp(result, expected))
+	  printf("SHA256(%.20s) failed: %s\n", input, result);
+     else
+	  printf("SHA256(%.20s) OK\n", input);
+}
+
+int
+main(void)
+{
+     struct sha256_ctx ctx;
+     unsigned char digest[SHA256_DIGEST_SIZE];
+     unsigned long size = 64 << 20;
+     unsigned char *buf;
+     clock_t start;
+     double secs;
+
+     test("", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+     test("abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+     test("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+	  "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+     test("a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+     buf = malloc(size);
+     if (!buf)
+	  return 1;
+     memset(buf, 0x5a, size);
+     start = clock();
+     sha256_init(&ctx);
+     sha256_update(&ctx, buf, size);
+     sha256_final(&ctx, digest);
+     secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+     printf("%lu MB in %.2fs, %.1f MB/s\n", size >> 20, secs,
+	    secs > 0 ? (size >> 20) / secs : 0.0);
+     free(buf);
+     return 0;
+}
+
+#endif /* TEST */
+
+/*
+ * Local variables:
+ * c-file-style: "k&r"
+ * c-basic-offset: 5
+ * End:
+ */
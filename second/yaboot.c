@@ -53,7 +53,10 @@
 #include "yaboot.h"
 #include "linux/elf.h"
 #include "bootinfo.h"
+#include "gunzip.h"
+#include "sha256.h"
 #include "debug.h"
+#include "bcache.h"
 
 #define CONFIG_FILE_NAME	"yaboot.conf"
 #define CONFIG_FILE_MAX		0x8000		/* 32k */
@@ -87,8 +90,27 @@ typedef struct {
      unsigned long   offset;
      unsigned long   load_loc;
      unsigned long   entry;
+     unsigned long   text_start;	/* from base, the executable segments */
+     unsigned long   text_end;
 } loadinfo_t;
 
+/* The start of the kernel image, read in one go so the ELF and program
+ * headers come out of memory instead of a read each */
+#define ELF_HEAD_SIZE	0x10000
+
+struct elf_head {
+     unsigned char	*buf;
+     unsigned int	len;
+};
+
+/* A PT_LOAD segment, whatever the ELF class */
+struct elf_seg {
+     unsigned long	offset;		/* in the file */
+     unsigned long	dest;		/* from loadinfo->base */
+     unsigned long	filesz;
+     int		exec;		/* PF_X, has to be flushed from the cache */
+};
+
 typedef void (*kernel_entry_t)( void *,
                                 unsigned long,
                                 prom_entry,
@@ -106,8 +128,19 @@ int	yaboot_start(unsigned long r3, unsigned long r4, unsigned long r5);
 static int	yaboot_main(void);
 static int	is_elf32(loadinfo_t *loadinfo);
 static int	is_elf64(loadinfo_t *loadinfo);
-static int      load_elf32(struct boot_file_t *file, loadinfo_t *loadinfo);
-static int      load_elf64(struct boot_file_t *file, loadinfo_t *loadinfo);
+static int      load_elf32(struct boot_file_t *file, loadinfo_t *loadinfo,
+			   struct elf_head *head, int loaded);
+static int      load_elf64(struct boot_file_t *file, loadinfo_t *loadinfo,
+			   struct elf_head *head, int loaded);
+static int	load_kernel(struct boot_fspec_t *fspec, loadinfo_t *loadinfo,
+			    const unsigned char *digest);
+static int	load_initrd(struct boot_fspec_t *fspec, loadinfo_t *loadinfo,
+			    void **base, unsigned long *size,
+			    unsigned long *claimed, const unsigned char *digest);
+static int	load_digests(struct boot_param_t *params,
+			     unsigned char *kernel, unsigned char *rd);
+static int	preload_default(char *imagename, int end);
+static void	preload_discard(void);
 static void     setup_display(void);
 
 /* Locals & globals */
@@ -124,6 +157,38 @@ struct boot_fspec_t boot;
 int _machine = _MACH_Pmac;
 int flat_vmlinux;
 
+/* Speculative load of the default image while the boot: prompt counts
+ * down.  The kernel and initrd are read in PRELOAD_CHUNKSIZE pieces
+ * with the keyboard polled in between; a key aborts the load and
+ * releases its claims.  A completed preload is handed to
+ * yaboot_text_ui() if the prompt falls through to the same image.
+ */
+#define PRELOAD_CHUNKSIZE	0x10000
+
+static int preload_active;	/* loading behind the boot: prompt */
+static int preload_deadline;	/* prom_getms() when the prompt times out */
+static int preload_key = -1;	/* key which interrupted the preload */
+
+static struct {
+     int			valid;
+     int			class;
+     int			flat_vmlinux;
+     struct boot_param_t	params;
+     loadinfo_t		loadinfo;
+     void		*initrd_base;
+     unsigned long	initrd_size;
+     unsigned long	initrd_claimed;
+} preload;
+
+/* Loader diagnostics are held back while preloading, a failed preload
+ * is simply done again in the foreground where they get printed.
+ */
+#define load_printf(fmt, args...)				\
+     do {							\
+	  if (!preload_active)					\
+	       prom_printf(fmt, ## args);			\
+     } while (0)
+
 #ifdef CONFIG_COLOR_TEXT
 
 /* Color values for text ui */
@@ -221,6 +286,9 @@ yaboot_start (unsigned long r3, unsigned long r4, unsigned long r5)
      /* Call out main */
      result = yaboot_main();
 
+     /* Close the devices still held by mounted filesystems */
+     fs_umount_all();
+
      /* Get rid of malloc pool */
      malloc_dispose();
      prom_release(malloc_base, MALLOCSIZE);
@@ -317,8 +385,13 @@ load_config_file(struct boot_fspec_t *fspec)
 {
      char *conf_file = NULL, *p;
      struct boot_file_t file;
+     struct arena *prev;
      int sz, opened = 0, result = 0;
 
+     /* The parsed config is kept until we boot, whichever boot attempt
+      * asked for it */
+     prev = arena_enter(&arena_long);
+
      /* Allocate a buffer for the config file */
      conf_file = malloc(CONFIG_FILE_MAX);
      if (!conf_file) {
@@ -380,6 +453,9 @@ load_config_file(struct boot_fspec_t *fspec)
 
      password = cfg_get_strg(0, "password");
 
+     of_net_tftp_options(cfg_get_strg(0, "tftp-blksize"),
+			 cfg_get_strg(0, "tftp-windowsize"));
+
 #ifdef CONFIG_COLOR_TEXT
      p = cfg_get_strg(0, "fgcolor");
      if (p) {
@@ -429,6 +505,7 @@ bail:
      if (conf_file)
 	  free(conf_file);
 
+     arena_leave(prev);
      return result;
 }
 
@@ -650,6 +727,7 @@ int get_params(struct boot_param_t* params)
      params->args = "";
      params->kernel.part = -1;
      params->rd.part = -1;
+     params->sha256.part = -1;
      defpart = boot.part;
 
      cmdinit();
@@ -682,10 +760,13 @@ int get_params(struct boot_param_t* params)
 	  beg = prom_getms();
 	  if (timeout > 0) {
 	       end = beg + 100 * timeout;
-	       do {
+	       c = preload_default(imagename, end);
+	       while (c == -1 && prom_getms() <= end)
 		    c = prom_nbgetchar();
-	       } while (c == -1 && prom_getms() <= end);
 	  }
+	  /* Anything but accepting the default throws the preload away */
+	  if (c != -1 && c != '\n' && c != '\r')
+	       preload_discard();
 	  if (c == -1)
 	       c = '\n';
 	  else if (c != '\n' && c != '\t' && c != '\r' && c != '\b' ) {
@@ -855,7 +936,8 @@ int get_params(struct boot_param_t* params)
 	       "on Yaboot's prompt:\n"
 	       "conf [device=device] [partition=partno] [file=/path/to/configfile]\n\n"
 	       "If you omit \"device\" and \"partno\", Yaboot will use their current\n"
-	       "values. You can check them by entering \"conf\" on Yaboot's prompt.\n");
+	       "values. You can check them by entering \"conf\" on Yaboot's prompt.\n\n"
+	       "To show the boot loader's memory usage, enter \"meminfo\".\n");
 
 	  return 0;
      }
@@ -866,6 +948,10 @@ int get_params(struct boot_param_t* params)
 	  prom_pause();
 	  return 0;
      }
+     if (!strcmp (imagename, "meminfo")) {
+	  malloc_stats();
+	  return 0;
+     }
      if (!strcmp (imagename, "bye")) {
 	  if (password) {
 	       check_password ("Restricted command.");
@@ -1001,10 +1087,654 @@ int get_params(struct boot_param_t* params)
 		    return 0;
 	       }
 	  }
+	  p = cfg_get_strg(label, "sha256");
+	  if (p && *p) {
+	       strncpy(initrdpath, p, 1024);
+	       params->sha256 = boot;
+	       if (!parse_device_path(initrdpath, defdevice, defpart,
+				      "/SHA256SUMS", &params->sha256)) {
+		    prom_printf("%s: Unable to parse\n", initrdpath);
+		    return 0;
+	       }
+	  }
      }
      return 0;
 }
 
+/* Files given relative to a blessed "\\" boot directory live in it */
+static int
+prepend_boot_dir(char **file)
+{
+     char *loc;
+
+     if (!strlen(boot.file) || strcmp(boot.file, "\\\\")
+	 || (*file)[0] == '/' || (*file)[0] == '\\')
+	  return 1;
+
+     loc = (char*)malloc(strlen(*file)+3);
+     if (!loc) {
+	  prom_printf ("malloc error\n");
+	  return 0;
+     }
+     strcpy(loc, boot.file);
+     strcat(loc, *file);
+     free(*file);
+     *file = loc;
+     return 1;
+}
+
+/* Read like fs->read(), but poll the keyboard between chunks while
+ * preloading behind the prompt.  Returns short if a key was pressed.
+ */
+static int
+load_read(struct boot_file_t *file, unsigned int size, void *buffer)
+{
+     unsigned int done = 0, chunk;
+     int got, c;
+
+     while (done < size) {
+	  chunk = size - done;
+	  if (preload_active && prom_getms() <= preload_deadline) {
+	       c = prom_nbgetchar();
+	       if (c != -1) {
+		    preload_key = c;
+		    break;
+	       }
+	       if (chunk > PRELOAD_CHUNKSIZE)
+		    chunk = PRELOAD_CHUNKSIZE;
+	  }
+	  got = file->fs->read(file, chunk, buffer + done);
+	  if (got <= 0)
+	       break;
+	  done += got;
+	  if (got < chunk)
+	       break;
+     }
+     return done;
+}
+
+/* Can a segment be moved to dest within a loaded image?  next tracks
+ * where the previous segment ended in the file.
+ */
+static int
+segment_in_place(struct boot_file_t *file, unsigned long dest,
+		 unsigned long offset, unsigned long filesz,
+		 unsigned long memsize, unsigned long *next)
+{
+     if (dest > offset || offset < *next || offset + filesz > file->len
+	 || offset + filesz > memsize)
+	  return 0;
+     *next = offset + filesz;
+     return 1;
+}
+
+/* Claim the kernel memory.  With *in_place set the image loaded in
+ * file->buffer is taken over, grown or trimmed to memsize, if the
+ * kernel fits there: a vmlinux anywhere from loadaddr up that keeps all
+ * of memsize below the claim ceiling, anything else only at loadaddr
+ * itself since it can't move.  Otherwise *in_place is cleared and fresh
+ * memory claimed.
+ */
+static void *
+claim_kernel(struct boot_file_t *file, int *in_place,
+	     unsigned long loadaddr, unsigned long memsize)
+{
+     void *base = file->buffer, *end;
+     unsigned long start = (unsigned long)base;
+
+     if (flat_vmlinux ? start < loadaddr : start != loadaddr)
+	  *in_place = 0;
+     if (start + memsize < start || start + memsize > prom_claim_ceiling())
+	  *in_place = 0;
+     if (*in_place) {
+	  end = base + file->buffer_size;
+	  if (memsize <= file->buffer_size
+	      || prom_claim(end, memsize - file->buffer_size, 0) == end) {
+	       if (file->buffer_size > memsize)
+		    prom_release(base + memsize, file->buffer_size - memsize);
+	       file->buffer = NULL;
+	       file->buffer_size = 0;
+	       DEBUG_F("using the loaded image in place at %p\n", base);
+	       return base;
+	  }
+     }
+     *in_place = 0;
+     return prom_claim_chunk((void *)loadaddr, memsize, 0);
+}
+
+/* Copy size bytes at offset in the image to dest, out of the head as
+ * far as it has them and read from the file after that.  Returns 1 if
+ * all of it was there.
+ */
+static int
+elf_read(struct boot_file_t *file, struct elf_head *head,
+	 unsigned long offset, unsigned long size, void *dest)
+{
+     unsigned long n = 0;
+
+     if (offset < head->len) {
+	  n = head->len - offset;
+	  if (n > size)
+	       n = size;
+	  memcpy(dest, head->buf + offset, n);
+	  if (n == size)
+	       return 1;
+     }
+     if (file->fs->seek(file, offset + n) != FILE_ERR_OK)
+	  return 0;
+     return load_read(file, size - n, dest + n) == size - n;
+}
+
+/* Load the segments, with a single read for each run of them that
+ * follows on both in the file and in memory.  A kernel loaded whole
+ * only has its segments moved down into place.  What the executable
+ * segments span is noted for the cache flush before entering it.
+ */
+static int
+load_segments(struct boot_file_t *file, loadinfo_t *loadinfo,
+	      struct elf_head *head, struct elf_seg *seg, int nseg, int loaded)
+{
+     unsigned long offset, dest, len;
+     int i, j, exec = 0;
+
+     for (i = 0; i < nseg; i++)
+	  exec |= seg[i].exec;
+     loadinfo->text_start = ~0UL;
+     loadinfo->text_end = 0;
+     for (i = 0; i < nseg; i++) {
+	  /* Without any flagged, assume they all are */
+	  if (exec && !seg[i].exec)
+	       continue;
+	  if (seg[i].dest < loadinfo->text_start)
+	       loadinfo->text_start = seg[i].dest;
+	  if (seg[i].dest + seg[i].filesz > loadinfo->text_end)
+	       loadinfo->text_end = seg[i].dest + seg[i].filesz;
+     }
+     if (loadinfo->text_start > loadinfo->text_end)
+	  loadinfo->text_start = loadinfo->text_end;
+
+     for (i = 0; i < nseg; i = j) {
+	  offset = seg[i].offset;
+	  dest = seg[i].dest;
+	  len = seg[i].filesz;
+	  for (j = i + 1; j < nseg && seg[j].offset == offset + len
+		    && seg[j].dest == dest + len; j++)
+	       len += seg[j].filesz;
+
+	  DEBUG_F("segments %d-%d: 0x%lx bytes at 0x%lx to +0x%lx\n",
+		  i, j - 1, len, offset, dest);
+	  if (loaded)
+	       memmove(loadinfo->base+dest, loadinfo->base+offset, len);
+	  else if (!elf_read(file, head, offset, len, loadinfo->base+dest)) {
+	       load_printf ("Read failed\n");
+	       return 0;
+	  }
+     }
+     return 1;
+}
+
+/* Digest lists are small, one line per file */
+#define DIGEST_LIST_SIZE	0x2000
+
+static int
+hex_digit(int c)
+{
+     if (c >= '0' && c <= '9')
+	  return c - '0';
+     if (c >= 'a' && c <= 'f')
+	  return c - 'a' + 10;
+     if (c >= 'A' && c <= 'F')
+	  return c - 'A' + 10;
+     return -1;
+}
+
+/* Find the digest of file in a sha256sum style list: lines of the hex
+ * digest, white space and a file name, matched by its last component.
+ */
+static int
+digest_lookup(const char *list, const char *file, unsigned char *digest)
+{
+     const char *name = file, *line, *end, *entry, *p;
+     int i, hi, lo;
+
+     for (p = file; *p; p++)
+	  if (*p == '/' || *p == '\\')
+	       name = p + 1;
+
+     for (line = list; *line; line = *end ? end + 1 : end) {
+	  end = strchr(line, '\n');
+	  if (!end)
+	       end = line + strlen(line);
+	  if (end - line <= 2 * SHA256_DIGEST_SIZE)
+	       continue;
+	  for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+	       hi = hex_digit(line[2 * i]);
+	       lo = hex_digit(line[2 * i + 1]);
+	       if (hi < 0 || lo < 0)
+		    break;
+	       digest[i] = (hi << 4) | lo;
+	  }
+	  if (i < SHA256_DIGEST_SIZE)
+	       continue;
+
+	  p = line + 2 * SHA256_DIGEST_SIZE;
+	  while (p < end && (*p == ' ' || *p == '\t' || *p == '*'))
+	       p++;
+	  for (entry = p; p < end; p++)
+	       if (*p == '/' || *p == '\\')
+		    entry = p + 1;
+	  if (p > entry && p[-1] == '\r')
+	       p--;
+	  if (p - entry == strlen(name) && !strncmp(entry, name, p - entry))
+	       return 1;
+     }
+     return 0;
+}
+
+/* Read the list the label's sha256= names and find the kernel's digest
+ * in it, and the ramdisk's if there is one.  Both have to be there.
+ */
+static int
+load_digests(struct boot_param_t *params, unsigned char *kernel, unsigned char *rd)
+{
+     struct boot_file_t	file;
+     char		*list;
+     int			result, ok = 0;
+
+     memset(&file, 0, sizeof(file));
+     result = open_file(&params->sha256, &file);
+     if (result != FILE_ERR_OK) {
+	  if (!preload_active) {
+	       prom_printf("%s:%d,", params->sha256.dev, params->sha256.part);
+	       prom_perror(result, params->sha256.file);
+	  }
+	  return 0;
+     }
+     list = malloc(DIGEST_LIST_SIZE);
+     if (list) {
+	  result = file.fs->read(&file, DIGEST_LIST_SIZE - 1, list);
+	  list[result > 0 ? result : 0] = 0;
+	  if (!digest_lookup(list, params->kernel.file, kernel))
+	       load_printf("%s: no SHA-256 in %s\n", params->kernel.file,
+			   params->sha256.file);
+	  else if (params->rd.file && !digest_lookup(list, params->rd.file, rd))
+	       load_printf("%s: no SHA-256 in %s\n", params->rd.file,
+			   params->sha256.file);
+	  else
+	       ok = 1;
+	  free(list);
+     }
+     file.fs->close(&file);
+     return ok;
+}
+
+/* Open the kernel image and load its segments.  Returns the ELF
+ * class loaded (32 or 64), or 0 on failure.  With a digest, the image
+ * is hashed as it is read and refused if it doesn't match.
+ */
+static int
+load_kernel(struct boot_fspec_t *fspec, loadinfo_t *loadinfo,
+	    const unsigned char *digest)
+{
+     struct boot_file_t	file;
+     struct sha256_file	*hash = NULL;
+     struct elf_head	head;
+     int			result, class = 0, loaded = 0, gzipped;
+
+     memset(&file, 0, sizeof(file));
+     result = open_file(fspec, &file);
+     if (result == FILE_ERR_OK && file.fs->load) {
+	  /* Netboot images come in whole, straight where the kernel goes.
+	   * Without room for that they are read from the driver's buffer. */
+	  result = file.fs->load(&file, (void *)KERNELADDR);
+	  loaded = result == FILE_ERR_OK;
+	  if (result == FILE_ERR_NOMEM)
+	       result = FILE_ERR_OK;
+	  else if (result != FILE_ERR_OK)
+	       file.fs->close(&file);
+     }
+     if (result != FILE_ERR_OK) {
+	  if (!preload_active) {
+	       prom_printf("%s:%d,", fspec->dev, fspec->part);
+	       prom_perror(result, fspec->file);
+	  }
+	  return 0;
+     }
+
+     /* An image loaded whole is hashed where it lies, anything else
+      * as it is read, compressed as it is on disk */
+     if (digest) {
+	  if (loaded) {
+	       if (!sha256_match(file.buffer, file.len, digest)) {
+		    load_printf("%s: SHA-256 mismatch, not booting it\n",
+				fspec->file);
+		    file.fs->close(&file);
+		    return 0;
+	       }
+	  } else if ((hash = sha256_open(&file)) == NULL) {
+	       load_printf ("Malloc error\n");
+	       file.fs->close(&file);
+	       return 0;
+	  }
+     }
+
+     /* Compressed kernels are inflated as they are read.  A netboot
+      * image loaded whole is then only the input. */
+     result = gunzip_open(&file);
+     gzipped = result == 1;
+     if (gzipped)
+	  loaded = 0;
+     else if (result < 0) {
+	  if (result == FILE_ERR_BAD_TYPE)
+	       load_printf("%s: zstd compressed, only gzip is supported\n",
+			   fspec->file);
+	  else
+	       load_printf("%s: can't decompress\n", fspec->file);
+	  file.fs->close(&file);
+	  return 0;
+     }
+
+     head.buf = malloc(ELF_HEAD_SIZE);
+     if (!head.buf) {
+	  load_printf ("Malloc error\n");
+	  file.fs->close(&file);
+	  return 0;
+     }
+     result = file.fs->read(&file, ELF_HEAD_SIZE, head.buf);
+     head.len = result > 0 ? result : 0;
+
+     /* The Elf e_ident, e_type and e_machine fields determine the
+      * Elf file type
+      */
+     memset(&loadinfo->elf, 0, sizeof(loadinfo->elf));
+     memcpy(&loadinfo->elf, head.buf,
+	    head.len < sizeof(loadinfo->elf) ? head.len : sizeof(loadinfo->elf));
+     if (head.len < sizeof(Elf_Ident))
+	  load_printf("\nCan't read Elf e_ident/e_type/e_machine info\n");
+     else if (is_elf32(loadinfo)) {
+	  if (load_elf32(&file, loadinfo, &head, loaded))
+	       class = 32;
+     } else if (is_elf64(loadinfo)) {
+	  if (load_elf64(&file, loadinfo, &head, loaded))
+	       class = 64;
+     } else
+	  load_printf("%s: Not a valid ELF image\n", fspec->file);
+
+     /* The gzip CRC is at the end, past where the loader stopped */
+     if (class && gzipped && preload_key == -1 && !gunzip_check(&file)) {
+	  load_printf("%s: corrupt compressed image, not booting it\n",
+		      fspec->file);
+	  prom_release(loadinfo->base, loadinfo->memsize);
+	  class = 0;
+     }
+     if (class && hash && preload_key == -1 && !sha256_check(hash, digest)) {
+	  load_printf("%s: SHA-256 mismatch, not booting it\n", fspec->file);
+	  prom_release(loadinfo->base, loadinfo->memsize);
+	  class = 0;
+     }
+
+     free(head.buf);
+     file.fs->close(&file);
+     return class;
+}
+
+/* Load the ramdisk right after the kernel.  The memory claimed is
+ * returned in *claimed so it can be given back if the boot is aborted.
+ * When the filesystem knows the file size the ramdisk is claimed and
+ * read in one go, otherwise it is grown a chunk at a time.
+ */
+static int
+load_initrd(struct boot_fspec_t *fspec, loadinfo_t *loadinfo,
+	    void **base, unsigned long *size, unsigned long *claimed,
+	    const unsigned char *digest)
+{
+#define INITRD_CHUNKSIZE 0x100000
+     struct boot_file_t	file;
+     struct sha256_file	*hash = NULL;
+     int			result;
+     unsigned int	len = 0;
+     void		*more, *want;
+     unsigned long	got;
+
+     *base = 0;
+     *size = *claimed = 0;
+
+     memset(&file, 0, sizeof(file));
+     result = open_file(fspec, &file);
+     if (result != FILE_ERR_OK) {
+	  if (!preload_active) {
+	       prom_printf("%s:%d,", fspec->dev, fspec->part);
+	       prom_perror(result, fspec->file);
+	  }
+	  return 0;
+     }
+
+     /* Netboot ramdisks are loaded straight after the kernel */
+     if (file.fs->load) {
+	  result = file.fs->load(&file, loadinfo->base+loadinfo->memsize);
+	  if (result == FILE_ERR_OK && digest
+	      && !sha256_match(file.buffer, file.len, digest)) {
+	       load_printf("%s: SHA-256 mismatch\n", fspec->file);
+	       goto out;
+	  }
+	  if (result == FILE_ERR_OK) {
+	       *base = file.buffer;
+	       *size = file.len;
+	       *claimed = file.buffer_size;
+	       file.buffer = NULL;
+	       file.buffer_size = 0;
+	       goto out;
+	  }
+	  if (result != FILE_ERR_NOMEM) {
+	       load_printf("%s: ramdisk load failed\n", fspec->file);
+	       goto out;
+	  }
+     }
+
+     if (digest && (hash = sha256_open(&file)) == NULL) {
+	  load_printf ("Malloc error\n");
+	  goto out;
+     }
+
+     if (file.fs->ino_size)
+	  len = file.fs->ino_size(&file);
+
+     if (len) {
+	  *claimed = (len + 0xfff) & ~0xfff;
+	  *base = prom_claim_chunk(loadinfo->base+loadinfo->memsize, *claimed, 0);
+	  if (*base == (void *)-1) {
+	       load_printf("Claim failed for initrd memory\n");
+	       *base = 0;
+	       *claimed = 0;
+	       goto out;
+	  }
+	  *size = load_read(&file, len, *base);
+	  if (*size != len && preload_key == -1) {
+	       load_printf("Short read of initrd: %lu of %u bytes\n", *size, len);
+	       *size = 0;
+	  }
+     } else {
+	  len = INITRD_CHUNKSIZE;
+	  *base = prom_claim_chunk(loadinfo->base+loadinfo->memsize, len, 0);
+	  if (*base == (void *)-1) {
+	       load_printf("Claim failed for initrd memory\n");
+	       *base = 0;
+	       goto out;
+	  }
+	  *claimed = len;
+
+	  got = *size = load_read(&file, len, *base);
+	  more = *base;
+	  while (got == len) { /* need to read more? */
+	       want = (void *)((unsigned long)more+len);
+	       more = prom_claim(want, len, 0);
+	       if (more != want) {
+		    load_printf("Claim failed for initrd memory at %p rc=%p\n",want,more);
+		    if (!preload_active)
+			 prom_pause();
+		    break;
+	       }
+	       *claimed += len;
+	       got = load_read(&file, len, more);
+	       DEBUG_F("  block at %p rc=%lu\n",more,got);
+	       *size += got;
+	  }
+     }
+
+     if (hash && *size && preload_key == -1 && !sha256_check(hash, digest)) {
+	  load_printf("%s: SHA-256 mismatch\n", fspec->file);
+	  *size = 0;
+     }
+     if (*size == 0 || preload_key != -1) {
+	  prom_release(*base, *claimed);
+	  *base = 0;
+	  *size = *claimed = 0;
+     }
+out:
+     file.fs->close(&file);
+     return *base != 0;
+}
+
+static int
+fspec_equal(struct boot_fspec_t *a, struct boot_fspec_t *b)
+{
+     return a->part == b->part
+	  && a->dev && b->dev && !strcmp(a->dev, b->dev)
+	  && a->file && b->file && !strcmp(a->file, b->file);
+}
+
+/* Preload the image the prompt would fall through to, if the config
+ * asks for it.  Returns the key which interrupted it, or -1.
+ */
+static int
+preload_default(char *imagename, int end)
+{
+     struct boot_param_t *params = &preload.params;
+     unsigned char kdigest[SHA256_DIGEST_SIZE], rddigest[SHA256_DIGEST_SIZE];
+     char name[1024], path[1024];
+     char *p, *q, *dev, *endp;
+     int part, n, key;
+
+     if (!useconf || !cfg_get_flag(0, "preload"))
+	  return -1;
+
+     if (imagename)
+	  p = imagename;
+     else if (bootoncelabel[0] != 0)
+	  p = bootoncelabel;
+     else if (bootlastlabel[0] != 0)
+	  p = bootlastlabel;
+     else
+	  p = cfg_get_default();
+     if (!p)
+	  return -1;
+     strncpy(name, p, sizeof(name) - 1);
+     name[sizeof(name) - 1] = 0;
+     if ((q = strchr(name, ' ')) != NULL)
+	  *q = 0;
+
+     p = cfg_get_strg(name, "image");
+     if (!p || !*p)
+	  return -1;
+     strncpy(path, p, sizeof(path));
+
+     /* Same device and partition defaulting as get_params() */
+     dev = cfg_get_strg(name, "device");
+     if (!dev)
+	  dev = boot.dev;
+     part = boot.part;
+     if ((q = cfg_get_strg(0, "partition")) != NULL) {
+	  n = simple_strtol(q, &endp, 10);
+	  if (endp != q && *endp == 0)
+	       part = n;
+     }
+     if ((q = cfg_get_strg(name, "partition")) != NULL) {
+	  n = simple_strtol(q, &endp, 10);
+	  if (endp != q && *endp == 0)
+	       part = n;
+     }
+
+     memset(params, 0, sizeof(*params));
+     params->kernel = boot;
+     if (!parse_device_path(path, dev, part, "/vmlinux", &params->kernel))
+	  return -1;
+     params->rd.part = -1;
+     p = cfg_get_strg(name, "initrd");
+     if (p && *p) {
+	  strncpy(path, p, sizeof(path));
+	  params->rd = boot;
+	  if (!parse_device_path(path, dev, part, "/root.bin", &params->rd))
+	       return -1;
+     }
+     params->sha256.part = -1;
+     p = cfg_get_strg(name, "sha256");
+     if (p && *p) {
+	  strncpy(path, p, sizeof(path));
+	  params->sha256 = boot;
+	  if (!parse_device_path(path, dev, part, "/SHA256SUMS", &params->sha256))
+	       return -1;
+     }
+     if (!prepend_boot_dir(&params->kernel.file) ||
+	 (params->rd.file && !prepend_boot_dir(&params->rd.file)) ||
+	 (params->sha256.file && !prepend_boot_dir(&params->sha256.file)))
+	  return -1;
+
+     DEBUG_F("preloading %s\n", name);
+     preload_active = 1;
+     preload_deadline = end;
+     preload_key = -1;
+
+     preload.class = 0;
+     if (!params->sha256.file || load_digests(params, kdigest, rddigest))
+	  preload.class = load_kernel(&params->kernel, &preload.loadinfo,
+				      params->sha256.file ? kdigest : NULL);
+     preload.flat_vmlinux = flat_vmlinux;
+     preload.initrd_base = 0;
+     if (preload.class && flat_vmlinux && params->rd.file &&
+	 !load_initrd(&params->rd, &preload.loadinfo, &preload.initrd_base,
+		      &preload.initrd_size, &preload.initrd_claimed,
+		      params->sha256.file ? rddigest : NULL)) {
+	  prom_release(preload.loadinfo.base, preload.loadinfo.memsize);
+	  preload.class = 0;
+     }
+     preload.valid = preload.class != 0;
+
+     key = preload_key;
+     preload_key = -1;
+     preload_active = 0;
+     DEBUG_F("preload %s\n", preload.valid ? "done" : "abandoned");
+     return key;
+}
+
+/* Is the preloaded image the one we were asked to boot? */
+static int
+preload_match(struct boot_param_t *params)
+{
+     if (!preload.valid || !fspec_equal(&preload.params.kernel, &params->kernel))
+	  return 0;
+     /* Checked against the same list, or neither was */
+     if (params->sha256.file
+	 ? !preload.params.sha256.file
+	   || !fspec_equal(&preload.params.sha256, &params->sha256)
+	 : preload.params.sha256.file != NULL)
+	  return 0;
+     if (preload.initrd_base)
+	  return params->rd.file && fspec_equal(&preload.params.rd, &params->rd);
+     return !(preload.flat_vmlinux && params->rd.file);
+}
+
+static void
+preload_discard(void)
+{
+     if (!preload.valid)
+	  return;
+     DEBUG_F("discarding preloaded image\n");
+     if (preload.initrd_base)
+	  prom_release(preload.initrd_base, preload.initrd_claimed);
+     prom_release(preload.loadinfo.base, preload.loadinfo.memsize);
+     preload.valid = 0;
+}
+
 /* This is derived from quik core. To be changed to first parse the headers
  * doing lazy-loading, and then claim the memory before loading the kernel
  * to it
@@ -1013,158 +1743,91 @@ int get_params(struct boot_param_t* params)
 void
 yaboot_text_ui(void)
 {
-     struct boot_file_t	file;
-     int			result;
+     int			class;
      static struct boot_param_t	params;
+     static struct arena	boot_arena = ARENA_INIT("boot attempt");
+     struct arena	*outer;
      void		*initrd_base;
-     unsigned long	initrd_size;
+     unsigned long	initrd_size, initrd_claimed;
+     unsigned char	kdigest[SHA256_DIGEST_SIZE];
+     unsigned char	rddigest[SHA256_DIGEST_SIZE];
      kernel_entry_t      kernel_entry;
-     char*               loc=NULL;
      loadinfo_t          loadinfo;
-     void                *initrd_more,*initrd_want;
-     unsigned long       initrd_read;
 
      loadinfo.load_loc = 0;
 
+     /* Paths, fspecs, headers and the like only live for one pass
+      * through the prompt */
+     outer = arena_enter(&boot_arena);
      for (;;) {
 	  initrd_size = 0;
 	  initrd_base = 0;
 
-	  if (get_params(&params))
+	  /* A preload is only good for the attempt that made it */
+	  preload_discard();
+	  arena_release(&boot_arena);
+
+	  if (get_params(&params)) {
+	       arena_leave(outer);
 	       return;
+	  }
 	  if (!params.kernel.file)
 	       continue;
 
 	  prom_printf("Please wait, loading kernel...\n");
 
-	  memset(&file, 0, sizeof(file));
-
-	  if (strlen(boot.file) && !strcmp(boot.file,"\\\\") && params.kernel.file[0] != '/'
-	      && params.kernel.file[0] != '\\') {
-	       loc=(char*)malloc(strlen(params.kernel.file)+3);
-	       if (!loc) {
-		    prom_printf ("malloc error\n");
-		    goto next;
-	       }
-	       strcpy(loc,boot.file);
-	       strcat(loc,params.kernel.file);
-	       free(params.kernel.file);
-	       params.kernel.file=loc;
-	  }
-	  result = open_file(&params.kernel, &file);
-	  if (result != FILE_ERR_OK) {
-	       prom_printf("%s:%d,", params.kernel.dev, params.kernel.part);
-	       prom_perror(result, params.kernel.file);
+	  if (!prepend_boot_dir(&params.kernel.file) ||
+	      (params.rd.file && !prepend_boot_dir(&params.rd.file)) ||
+	      (params.sha256.file && !prepend_boot_dir(&params.sha256.file)))
 	       goto next;
-	  }
 
-	  /* Read the Elf e_ident, e_type and e_machine fields to
-	   * determine Elf file type
-	   */
-	  if (file.fs->read(&file, sizeof(Elf_Ident), &loadinfo.elf) < sizeof(Elf_Ident)) {
-	       prom_printf("\nCan't read Elf e_ident/e_type/e_machine info\n");
-	       file.fs->close(&file);
-	       memset(&file, 0, sizeof(file));
-	       goto next;
-	  }
+	  if (preload_match(&params)) {
+	       loadinfo = preload.loadinfo;
+	       flat_vmlinux = preload.flat_vmlinux;
+	       initrd_base = preload.initrd_base;
+	       initrd_size = preload.initrd_size;
+	       preload.valid = 0;
+	       prom_printf("   Elf%d kernel preloaded...\n", preload.class);
+	       if (initrd_base)
+		    prom_printf("ramdisk preloaded at %p, size: %lu Kbytes\n",
+				initrd_base, initrd_size >> 10);
+	  } else {
+	       preload_discard();
 
-	  if (is_elf32(&loadinfo)) {
-	       if (!load_elf32(&file, &loadinfo)) {
-		    file.fs->close(&file);
-		    memset(&file, 0, sizeof(file));
+	       if (params.sha256.file && !load_digests(&params, kdigest, rddigest))
 		    goto next;
-	       }
-	       prom_printf("   Elf32 kernel loaded...\n");
-	  } else if (is_elf64(&loadinfo)) {
-	       if (!load_elf64(&file, &loadinfo)) {
-		    file.fs->close(&file);
-		    memset(&file, 0, sizeof(file));
+	       class = load_kernel(&params.kernel, &loadinfo,
+				   params.sha256.file ? kdigest : NULL);
+	       if (!class)
 		    goto next;
-	       }
-	       prom_printf("   Elf64 kernel loaded...\n");
-	  } else {
-	       prom_printf ("%s: Not a valid ELF image\n", params.kernel.file);
-	       file.fs->close(&file);
-	       memset(&file, 0, sizeof(file));
-	       goto next;
-	  }
-	  file.fs->close(&file);
-	  memset(&file, 0, sizeof(file));
-
-	  /* If ramdisk, load it (only if booting a vmlinux).  For now, we
-	   * can't tell the size it will be so we claim an arbitrary amount
-	   * of 4Mb.
-	   */
-	  if (flat_vmlinux && params.rd.file) {
-	       if(strlen(boot.file) && !strcmp(boot.file,"\\\\") && params.rd.file[0] != '/'
-		  && params.kernel.file[0] != '\\')
-	       {
-		    if (loc) free(loc);
-		    loc=(char*)malloc(strlen(params.rd.file)+3);
-		    if (!loc) {
-			 prom_printf ("Malloc error\n");
-			 goto next;
-		    }
-		    strcpy(loc,boot.file);
-		    strcat(loc,params.rd.file);
-		    free(params.rd.file);
-		    params.rd.file=loc;
-	       }
-	       prom_printf("Loading ramdisk...\n");
-	       result = open_file(&params.rd, &file);
-	       if (result != FILE_ERR_OK) {
-		    prom_printf("%s:%d,", params.rd.dev, params.rd.part);
-		    prom_perror(result, params.rd.file);
-	       }
-	       else {
-#define INITRD_CHUNKSIZE 0x100000
-		    unsigned int len = INITRD_CHUNKSIZE;
-
-		    /* We add a bit to the actual size so the loop below doesn't think
-		     * there is more to load.
-		     */
-		    if (file.fs->ino_size && file.fs->ino_size(&file) > 0)
-			 len = file.fs->ino_size(&file) + 0x1000;
-
-		    initrd_base = prom_claim_chunk(loadinfo.base+loadinfo.memsize, len, 0);
-		    if (initrd_base == (void *)-1) {
-			 prom_printf("Claim failed for initrd memory\n");
-			 initrd_base = 0;
-		    } else {
-			 initrd_size = file.fs->read(&file, len, initrd_base);
-			 if (initrd_size == 0)
-			      initrd_base = 0;
-			 initrd_read = initrd_size;
-			 initrd_more = initrd_base;
-			 while (initrd_read == len ) { /* need to read more? */
-			      initrd_want = (void *)((unsigned long)initrd_more+len);
-			      initrd_more = prom_claim(initrd_want, len, 0);
-			      if (initrd_more != initrd_want) {
-				   prom_printf("Claim failed for initrd memory at %p rc=%p\n",initrd_want,initrd_more);
-				   prom_pause();
-				   break;
-			      }
-			      initrd_read = file.fs->read(&file, len, initrd_more);
-			      DEBUG_F("  block at %p rc=%lu\n",initrd_more,initrd_read);
-			      initrd_size += initrd_read;
+	       prom_printf("   Elf%d kernel loaded...\n", class);
+
+	       /* If ramdisk, load it (only if booting a vmlinux) */
+	       if (flat_vmlinux && params.rd.file) {
+		    prom_printf("Loading ramdisk...\n");
+		    if (load_initrd(&params.rd, &loadinfo, &initrd_base,
+				    &initrd_size, &initrd_claimed,
+				    params.sha256.file ? rddigest : NULL))
+			 prom_printf("ramdisk loaded at %p, size: %lu Kbytes\n",
+				     initrd_base, initrd_size >> 10);
+		    else {
+			 prom_printf("ramdisk load failed !\n");
+			 prom_pause();
+			 /* Not without the ramdisk it was checked with */
+			 if (params.sha256.file) {
+			      prom_release(loadinfo.base, loadinfo.memsize);
+			      goto next;
 			 }
 		    }
-		    file.fs->close(&file);
-		    memset(&file, 0, sizeof(file));
-	       }
-	       if (initrd_base)
-		    prom_printf("ramdisk loaded at %p, size: %lu Kbytes\n",
-				initrd_base, initrd_size >> 10);
-	       else {
-		    prom_printf("ramdisk load failed !\n");
-		    prom_pause();
 	       }
 	  }
 
 	  DEBUG_F("setting kernel args to: %s\n", params.args);
 	  prom_setargs(params.args);
-	  DEBUG_F("flushing icache...");
-	  flush_icache_range ((long)loadinfo.base, (long)loadinfo.base+loadinfo.memsize);
+	  DEBUG_F("flushing icache 0x%lx-0x%lx...", loadinfo.text_start,
+		  loadinfo.text_end);
+	  flush_icache_range ((long)loadinfo.base+loadinfo.text_start,
+			      (long)loadinfo.base+loadinfo.text_end);
 	  DEBUG_F(" done\n");
 
           /* compute the kernel's entry point. */
@@ -1178,6 +1841,9 @@ yaboot_text_ui(void)
 		  "        arg5 = %d\n\n",
 		  initrd_base + loadinfo.load_loc, initrd_size, prom, 0, 0);
 
+	  bcache_print_stats();
+	  fs_umount_all();
+
 	  DEBUG_F("Entering kernel...\n");
 
 	  prom_print_available();
@@ -1191,17 +1857,18 @@ yaboot_text_ui(void)
 }
 
 static int
-load_elf32(struct boot_file_t *file, loadinfo_t *loadinfo)
+load_elf32(struct boot_file_t *file, loadinfo_t *loadinfo,
+	   struct elf_head *head, int loaded)
 {
-     int			i;
+     int			i, nseg = 0;
      Elf32_Ehdr		*e = &(loadinfo->elf.elf32hdr);
-     Elf32_Phdr		*p, *ph;
-     int			size = sizeof(Elf32_Ehdr) - sizeof(Elf_Ident);
+     Elf32_Phdr		*p, *ph = NULL;
+     struct elf_seg	*seg = NULL;
      unsigned long	loadaddr;
 
-     /* Read the rest of the Elf header... */
-     if ((*(file->fs->read))(file, size, &e->e_version) < size) {
-	  prom_printf("\nCan't read Elf32 image header\n");
+     /* The rest of the Elf header came with the head */
+     if (head->len < sizeof(Elf32_Ehdr)) {
+	  load_printf("\nCan't read Elf32 image header\n");
 	  goto bail;
      }
 
@@ -1220,19 +1887,15 @@ load_elf32(struct boot_file_t *file, loadinfo_t *loadinfo)
      loadinfo->entry = e->e_entry;
 
      ph = (Elf32_Phdr *)malloc(sizeof(Elf32_Phdr) * e->e_phnum);
-     if (!ph) {
-	  prom_printf ("Malloc error\n");
+     seg = malloc(sizeof(struct elf_seg) * e->e_phnum);
+     if (!ph || !seg) {
+	  load_printf ("Malloc error\n");
 	  goto bail;
      }
 
-     /* Now, we read the section header */
-     if ((*(file->fs->seek))(file, e->e_phoff) != FILE_ERR_OK) {
-	  prom_printf ("seek error\n");
-	  goto bail;
-     }
-     if ((*(file->fs->read))(file, sizeof(Elf32_Phdr) * e->e_phnum, ph) !=
-	 sizeof(Elf32_Phdr) * e->e_phnum) {
-	  prom_printf ("read error\n");
+     /* Now, we read the program header, usually all in the head */
+     if (!elf_read(file, head, e->e_phoff, sizeof(Elf32_Phdr) * e->e_phnum, ph)) {
+	  load_printf ("read error\n");
 	  goto bail;
      }
 
@@ -1247,6 +1910,11 @@ load_elf32(struct boot_file_t *file, loadinfo_t *loadinfo)
      for (i = 0; i < e->e_phnum; ++i, ++p) {
 	  if (p->p_type != PT_LOAD || p->p_offset == 0)
 	       continue;
+	  seg[nseg].offset = p->p_offset;
+	  seg[nseg].dest = p->p_vaddr;
+	  seg[nseg].filesz = p->p_filesz;
+	  seg[nseg].exec = p->p_flags & PF_X;
+	  nseg++;
 	  if (loadinfo->memsize == 0) {
 	       loadinfo->offset = p->p_offset;
 	       loadinfo->memsize = p->p_memsz;
@@ -1259,9 +1927,11 @@ load_elf32(struct boot_file_t *file, loadinfo_t *loadinfo)
      }
 
      if (loadinfo->memsize == 0) {
-	  prom_printf("Can't find a loadable segment !\n");
+	  load_printf("Can't find a loadable segment !\n");
 	  goto bail;
      }
+     for (i = 0; i < nseg; i++)
+	  seg[i].dest -= loadinfo->load_loc;
 
      /* leave some room (1Mb) for boot infos */
      loadinfo->memsize = _ALIGN(loadinfo->memsize,(1<<20)) + 0x100000;
@@ -1280,9 +1950,20 @@ load_elf32(struct boot_file_t *file, loadinfo_t *loadinfo)
           loadaddr = loadinfo->load_loc;
      }
 
-     loadinfo->base = prom_claim_chunk((void *)loadaddr, loadinfo->memsize, 0);
+     /* A whole image loaded where the kernel goes can be used in place
+      * if its segments only have to move down, in file order */
+     if (loaded) {
+	  unsigned long next = 0;
+
+	  for (i = 0; i < nseg; i++)
+	       if (!segment_in_place(file, seg[i].dest, seg[i].offset,
+				     seg[i].filesz, loadinfo->memsize, &next))
+		    loaded = 0;
+     }
+
+     loadinfo->base = claim_kernel(file, &loaded, loadaddr, loadinfo->memsize);
      if (loadinfo->base == (void *)-1) {
-	  prom_printf("Claim error, can't allocate kernel memory\n");
+	  load_printf("Claim error, can't allocate kernel memory\n");
 	  goto bail;
      }
 
@@ -1292,49 +1973,38 @@ load_elf32(struct boot_file_t *file, loadinfo_t *loadinfo)
 	     loadaddr, loadinfo->memsize);
 
      /* Load the program segments... */
-     p = ph;
-     for (i = 0; i < e->e_phnum; ++i, ++p) {
-	  unsigned long offset;
-	  if (p->p_type != PT_LOAD || p->p_offset == 0)
-	       continue;
-
-	  /* Now, we skip to the image itself */
-	  if ((*(file->fs->seek))(file, p->p_offset) != FILE_ERR_OK) {
-	       prom_printf ("Seek error\n");
-	       prom_release(loadinfo->base, loadinfo->memsize);
-	       goto bail;
-	  }
-	  offset = p->p_vaddr - loadinfo->load_loc;
-	  if ((*(file->fs->read))(file, p->p_filesz, loadinfo->base+offset) != p->p_filesz) {
-	       prom_printf ("Read failed\n");
-	       prom_release(loadinfo->base, loadinfo->memsize);
-	       goto bail;
-	  }
+     if (!load_segments(file, loadinfo, head, seg, nseg, loaded)) {
+	  prom_release(loadinfo->base, loadinfo->memsize);
+	  goto bail;
      }
 
+     free(seg);
      free(ph);
 
      /* Return success at loading the Elf32 kernel */
      return 1;
 
 bail:
+     if (seg)
+       free(seg);
      if (ph)
        free(ph);
      return 0;
 }
 
 static int
-load_elf64(struct boot_file_t *file, loadinfo_t *loadinfo)
+load_elf64(struct boot_file_t *file, loadinfo_t *loadinfo,
+	   struct elf_head *head, int loaded)
 {
-     int			i;
+     int			i, nseg = 0;
      Elf64_Ehdr		*e = &(loadinfo->elf.elf64hdr);
-     Elf64_Phdr		*p, *ph;
-     int			size = sizeof(Elf64_Ehdr) - sizeof(Elf_Ident);
+     Elf64_Phdr		*p, *ph = NULL;
+     struct elf_seg	*seg = NULL;
      unsigned long	loadaddr;
 
-     /* Read the rest of the Elf header... */
-     if ((*(file->fs->read))(file, size, &e->e_version) < size) {
-	  prom_printf("\nCan't read Elf64 image header\n");
+     /* The rest of the Elf header came with the head */
+     if (head->len < sizeof(Elf64_Ehdr)) {
+	  load_printf("\nCan't read Elf64 image header\n");
 	  goto bail;
      }
 
@@ -1353,19 +2023,15 @@ load_elf64(struct boot_file_t *file, loadinfo_t *loadinfo)
      loadinfo->entry = e->e_entry;
 
      ph = (Elf64_Phdr *)malloc(sizeof(Elf64_Phdr) * e->e_phnum);
-     if (!ph) {
-	  prom_printf ("Malloc error\n");
+     seg = malloc(sizeof(struct elf_seg) * e->e_phnum);
+     if (!ph || !seg) {
+	  load_printf ("Malloc error\n");
 	  goto bail;
      }
 
-     /* Now, we read the section header */
-     if ((*(file->fs->seek))(file, e->e_phoff) != FILE_ERR_OK) {
-	  prom_printf ("Seek error\n");
-	  goto bail;
-     }
-     if ((*(file->fs->read))(file, sizeof(Elf64_Phdr) * e->e_phnum, ph) !=
-	 sizeof(Elf64_Phdr) * e->e_phnum) {
-	  prom_printf ("Read error\n");
+     /* Now, we read the program header, usually all in the head */
+     if (!elf_read(file, head, e->e_phoff, sizeof(Elf64_Phdr) * e->e_phnum, ph)) {
+	  load_printf ("Read error\n");
 	  goto bail;
      }
 
@@ -1380,6 +2046,11 @@ load_elf64(struct boot_file_t *file, loadinfo_t *loadinfo)
      for (i = 0; i < e->e_phnum; ++i, ++p) {
 	  if (p->p_type != PT_LOAD || p->p_offset == 0)
 	       continue;
+	  seg[nseg].offset = p->p_offset;
+	  seg[nseg].dest = p->p_vaddr;
+	  seg[nseg].filesz = p->p_filesz;
+	  seg[nseg].exec = p->p_flags & PF_X;
+	  nseg++;
 	  if (loadinfo->memsize == 0) {
 	       loadinfo->offset = p->p_offset;
 	       loadinfo->memsize = p->p_memsz;
@@ -1392,9 +2063,11 @@ load_elf64(struct boot_file_t *file, loadinfo_t *loadinfo)
      }
 
      if (loadinfo->memsize == 0) {
-	  prom_printf("Can't find a loadable segment !\n");
+	  load_printf("Can't find a loadable segment !\n");
 	  goto bail;
      }
+     for (i = 0; i < nseg; i++)
+	  seg[i].dest -= loadinfo->load_loc;
 
      loadinfo->memsize = _ALIGN(loadinfo->memsize,(1<<20));
      /* Claim OF memory */
@@ -1412,9 +2085,20 @@ load_elf64(struct boot_file_t *file, loadinfo_t *loadinfo)
           loadaddr = e->e_entry;
      }
 
-     loadinfo->base = prom_claim_chunk((void *)loadaddr, loadinfo->memsize, 0);
+     /* A whole image loaded where the kernel goes can be used in place
+      * if its segments only have to move down, in file order */
+     if (loaded) {
+	  unsigned long next = 0;
+
+	  for (i = 0; i < nseg; i++)
+	       if (!segment_in_place(file, seg[i].dest, seg[i].offset,
+				     seg[i].filesz, loadinfo->memsize, &next))
+		    loaded = 0;
+     }
+
+     loadinfo->base = claim_kernel(file, &loaded, loadaddr, loadinfo->memsize);
      if (loadinfo->base == (void *)-1) {
-	  prom_printf("Claim error, can't allocate kernel memory\n");
+	  load_printf("Claim error, can't allocate kernel memory\n");
 	  goto bail;
      }
 
@@ -1424,32 +2108,20 @@ load_elf64(struct boot_file_t *file, loadinfo_t *loadinfo)
 	     loadaddr, loadinfo->memsize);
 
      /* Load the program segments... */
-     p = ph;
-     for (i = 0; i < e->e_phnum; ++i, ++p) {
-	  unsigned long offset;
-	  if (p->p_type != PT_LOAD || p->p_offset == 0)
-	       continue;
-
-	  /* Now, we skip to the image itself */
-	  if ((*(file->fs->seek))(file, p->p_offset) != FILE_ERR_OK) {
-	       prom_printf ("Seek error\n");
-	       prom_release(loadinfo->base, loadinfo->memsize);
-	       goto bail;
-	  }
-	  offset = p->p_vaddr - loadinfo->load_loc;
-	  if ((*(file->fs->read))(file, p->p_filesz, loadinfo->base+offset) != p->p_filesz) {
-	       prom_printf ("Read failed\n");
-	       prom_release(loadinfo->base, loadinfo->memsize);
-	       goto bail;
-	  }
+     if (!load_segments(file, loadinfo, head, seg, nseg, loaded)) {
+	  prom_release(loadinfo->base, loadinfo->memsize);
+	  goto bail;
      }
 
+     free(seg);
      free(ph);
 
      /* Return success at loading the Elf64 kernel */
      return 1;
 
 bail:
+     if (seg)
+       free(seg);
      if (ph)
        free(ph);
      return 0;